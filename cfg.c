@@ -0,0 +1,106 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdbool.h>
+#include<string.h>
+#include"header.h"
+#include"cfg.h"
+
+Operations cfg_source_id(const Instr* instr){
+  if(instr->ID < OPCODE) return instr->ID;
+  for(int r=0; r<fusion_table_size; r++){
+    if(fusion_table[r].fused == instr->ID) return fusion_table[r].pattern[0];
+  }
+  for(int r=0; r<unchecked_table_size; r++){
+    if(unchecked_table[r].unchecked == instr->ID) return unchecked_table[r].checked;
+  }
+  return instr->ID;
+}
+
+bool cfg_is_terminator(Operations id){
+  switch(id){
+    case JMP: case JE: case JNE: case JG: case JGE: case JL: case JLE:
+    case CALL: case RET: case HLT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+//targets come from link_labels, anything outside the program is left for instr_jmp's fetch to fault on
+static int jump_target(const Instr* instr, int program_size){
+  int target = instr->operand1.target;
+  return (target >= 0 && target < program_size) ? target : -1;
+}
+
+static void add_succ(CFGBlock* blk, int b){
+  if(b < 0) return;
+  for(int s=0; s<blk->nsucc; s++){
+    if(blk->succ[s] == b) return;
+  }
+  blk->succ[blk->nsucc++] = b;
+}
+
+bool cfg_build(const Instr* program, int program_size, CFG* out){
+  memset(out, 0, sizeof(CFG));
+  if(!program || program_size < 1) return false;
+
+  bool *leader = calloc(program_size, sizeof(bool));
+  out->blocks = malloc(sizeof(CFGBlock) * program_size);
+  out->block_of = malloc(sizeof(int) * program_size);
+  if(!leader || !out->blocks || !out->block_of){
+    free(leader);
+    cfg_free(out);
+    return false;
+  }
+
+  leader[0] = true;
+  for(int i=0; i<program_size; i++){
+    Operations id = cfg_source_id(&program[i]);
+    if(id == LBL) leader[i] = true;
+    if(!cfg_is_terminator(id)) continue;
+    if(i + 1 < program_size) leader[i + 1] = true;
+    if(id != RET && id != HLT){
+      int target = jump_target(&program[i], program_size);
+      if(target >= 0) leader[target] = true;
+    }
+  }
+
+  for(int i=0; i<program_size; i++){
+    if(leader[i]){
+      CFGBlock *blk = &out->blocks[out->nblocks++];
+      blk->start = i;
+      blk->term = -1;
+      blk->nsucc = 0;
+    }
+    CFGBlock *blk = &out->blocks[out->nblocks - 1];
+    out->block_of[i] = out->nblocks - 1;
+    blk->end = i + 1;
+    if(cfg_is_terminator(cfg_source_id(&program[i]))) blk->term = i;
+  }
+
+  //successors need every block's index, so they're filled in a second pass
+  for(int b=0; b<out->nblocks; b++){
+    CFGBlock *blk = &out->blocks[b];
+    int next = (blk->end < program_size) ? b + 1 : -1;
+    if(blk->term < 0){
+      add_succ(blk, next);
+      continue;
+    }
+    Operations id = cfg_source_id(&program[blk->term]);
+    if(id == RET || id == HLT) continue;
+    int target = jump_target(&program[blk->term], program_size);
+    if(target >= 0) add_succ(blk, out->block_of[target]);
+    if(id != JMP) add_succ(blk, next);
+  }
+
+  out->program_size = program_size;
+  free(leader);
+  return true;
+}
+
+void cfg_free(CFG* cfg){
+  if(!cfg) return;
+  free(cfg->blocks);
+  free(cfg->block_of);
+  memset(cfg, 0, sizeof(CFG));
+}
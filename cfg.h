@@ -0,0 +1,39 @@
+#ifndef CFG_H
+#define CFG_H
+#include"header.h"
+
+//basic blocks over an assembled program. leaders are ip 0, labels, resolved jump/call targets and whatever
+//follows a JMP/Jcc/CALL/RET/HLT. fused instructions count as their first component, the rest stay in place,
+//and unchecked ones as the instruction they replaced
+
+#define CFG_MAX_SUCCS 2
+
+typedef struct CFGBlock{
+  int start; //first instruction
+  int end; //one past the last instruction
+  int term; //the JMP/Jcc/CALL/RET/HLT ending the block, -1 when it falls through into a leader or off the end
+  int succ[CFG_MAX_SUCCS]; //taken target first, then fallthrough (for CALL the return site). RET's are only known at run time
+  int nsucc;
+} CFGBlock;
+
+typedef struct CFG{
+  CFGBlock *blocks; //in program order
+  int nblocks;
+  int *block_of; //ip -> block containing it
+  int program_size;
+} CFG;
+
+bool cfg_build(const Instr* program, int program_size, CFG* out);
+void cfg_free(CFG* cfg);
+
+Operations cfg_source_id(const Instr* instr);
+bool cfg_is_terminator(Operations id);
+
+//block starting at ip, -1 if ip is out of range or inside a block
+static inline int cfg_block_at(const CFG* cfg, int ip){
+  if(ip < 0 || ip >= cfg->program_size) return -1;
+  int b = cfg->block_of[ip];
+  return cfg->blocks[b].start == ip ? b : -1;
+}
+
+#endif
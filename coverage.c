@@ -3,8 +3,13 @@
 #include<string.h>
 #include<ctype.h>
 #include<limits.h>
+#include<stdbool.h>
 #include <sys/mman.h>
 #include"coverage.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define COVERAGE_X86 1
+#endif
 
 uint8_t *vm_coverage_map;
 uint8_t *asm_coverage_map;
@@ -12,6 +17,191 @@ uint8_t *asm_coverage_map;
 uint32_t __prev_vm_loc = 0;
 uint32_t __prev_asm_loc = 0;
 
+//SCAN KERNELS
+//maps are 64K so every kernel works on whole 64-byte chunks, the size only has to be a multiple of 64.
+//untouched chunks are the common case and cost one test
+
+static uint32_t count_nonzero_scalar(const uint8_t* map, size_t size){
+  uint32_t count = 0;
+  for(size_t i=0; i<size; i++){
+    if(map[i] > 0) count++;
+  }
+  return count;
+}
+
+//virgin bytes start at 0xFF and lose each hit-count bucket bit once it has been seen. hits have to be
+//classified first. returns edges seen for the first time, already known edges reaching a new bucket go to new_buckets
+static uint32_t merge_virgin_scalar(const uint8_t* hits, uint8_t* virgin, size_t size, uint32_t* new_buckets){
+  uint32_t fresh = 0;
+  for(size_t i=0; i<size; i++){
+    uint8_t h = hits[i], v = virgin[i];
+    if(!(h & v)) continue;
+    if(v == 0xFF) fresh++;
+    else (*new_buckets)++;
+    virgin[i] = v & ~h;
+  }
+  return fresh;
+}
+
+#ifdef COVERAGE_X86
+static uint32_t count_nonzero_sse2(const uint8_t* map, size_t size){
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t count = 0;
+  for(size_t i=0; i<size; i+=64){
+    __m128i a = _mm_loadu_si128((const __m128i*)(map + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(map + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(map + i + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(map + i + 48));
+    __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) == 0xFFFF) continue;
+    uint64_t zeros = (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero))
+                   | (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(b, zero)) << 16
+                   | (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(c, zero)) << 32
+                   | (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)) << 48;
+    count += 64 - (uint32_t)__builtin_popcountll(zeros);
+  }
+  return count;
+}
+
+static uint32_t merge_virgin_sse2(const uint8_t* hits, uint8_t* virgin, size_t size, uint32_t* new_buckets){
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi8((char)0xFF);
+  uint32_t fresh = 0;
+  for(size_t i=0; i<size; i+=64){
+    __m128i h[4];
+    for(int k=0; k<4; k++) h[k] = _mm_loadu_si128((const __m128i*)(hits + i + 16 * k));
+    __m128i any = _mm_or_si128(_mm_or_si128(h[0], h[1]), _mm_or_si128(h[2], h[3]));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) == 0xFFFF) continue;
+    for(int k=0; k<4; k++){
+      __m128i *vp = (__m128i*)(virgin + i + 16 * k);
+      __m128i v = _mm_loadu_si128(vp);
+      unsigned new_bits = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(h[k], v), zero)) & 0xFFFF;
+      if(!new_bits) continue;
+      unsigned untouched = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones));
+      _mm_storeu_si128(vp, _mm_andnot_si128(h[k], v));
+      fresh += (uint32_t)__builtin_popcount(new_bits & untouched);
+      *new_buckets += (uint32_t)__builtin_popcount(new_bits & ~untouched);
+    }
+  }
+  return fresh;
+}
+
+__attribute__((target("avx2")))
+static uint32_t count_nonzero_avx2(const uint8_t* map, size_t size){
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t count = 0;
+  for(size_t i=0; i<size; i+=64){
+    __m256i a = _mm256_loadu_si256((const __m256i*)(map + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(map + i + 32));
+    if(_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) continue;
+    uint64_t zeros = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero))
+                   | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero)) << 32;
+    count += 64 - (uint32_t)__builtin_popcountll(zeros);
+  }
+  return count;
+}
+
+__attribute__((target("avx2")))
+static uint32_t merge_virgin_avx2(const uint8_t* hits, uint8_t* virgin, size_t size, uint32_t* new_buckets){
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi8((char)0xFF);
+  uint32_t fresh = 0;
+  for(size_t i=0; i<size; i+=64){
+    __m256i h[2];
+    h[0] = _mm256_loadu_si256((const __m256i*)(hits + i));
+    h[1] = _mm256_loadu_si256((const __m256i*)(hits + i + 32));
+    __m256i any = _mm256_or_si256(h[0], h[1]);
+    if(_mm256_testz_si256(any, any)) continue;
+    for(int k=0; k<2; k++){
+      __m256i *vp = (__m256i*)(virgin + i + 32 * k);
+      __m256i v = _mm256_loadu_si256(vp);
+      uint32_t new_bits = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(h[k], v), zero));
+      if(!new_bits) continue;
+      uint32_t untouched = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones));
+      _mm256_storeu_si256(vp, _mm256_andnot_si256(h[k], v));
+      fresh += (uint32_t)__builtin_popcount(new_bits & untouched);
+      *new_buckets += (uint32_t)__builtin_popcount(new_bits & ~untouched);
+    }
+  }
+  return fresh;
+}
+#endif
+
+static uint32_t (*count_nonzero_impl)(const uint8_t*, size_t);
+static uint32_t (*merge_virgin_impl)(const uint8_t*, uint8_t*, size_t, uint32_t*);
+
+//picks the widest kernel the CPU has, once. COVERAGE_NO_SIMD in the environment forces the scalar ones
+static void coverage_select_kernels(void){
+  count_nonzero_impl = count_nonzero_scalar;
+  merge_virgin_impl = merge_virgin_scalar;
+  if(getenv("COVERAGE_NO_SIMD")) return;
+#ifdef COVERAGE_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")){
+    count_nonzero_impl = count_nonzero_avx2;
+    merge_virgin_impl = merge_virgin_avx2;
+  } else if(__builtin_cpu_supports("sse2")){
+    count_nonzero_impl = count_nonzero_sse2;
+    merge_virgin_impl = merge_virgin_sse2;
+  }
+#endif
+}
+
+uint32_t coverage_count_nonzero(const uint8_t* map, size_t size){
+  if(!count_nonzero_impl) coverage_select_kernels();
+  if(size % 64) return count_nonzero_scalar(map, size);
+  return count_nonzero_impl(map, size);
+}
+
+uint32_t coverage_merge_virgin(const uint8_t* hits, uint8_t* virgin, size_t size, uint32_t* new_buckets){
+  if(!merge_virgin_impl) coverage_select_kernels();
+  if(size % 64) return merge_virgin_scalar(hits, virgin, size, new_buckets);
+  return merge_virgin_impl(hits, virgin, size, new_buckets);
+}
+
+//HIT-COUNT BUCKETS
+//AFL's classes: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ each get their own bit
+
+static const uint8_t count_class_lookup8[256] = {
+  [0] = 0,
+  [1] = 1,
+  [2] = 2,
+  [3] = 4,
+  [4 ... 7] = 8,
+  [8 ... 15] = 16,
+  [16 ... 31] = 32,
+  [32 ... 127] = 64,
+  [128 ... 255] = 128
+};
+
+//two bytes per lookup, 128K table built on first use
+static uint16_t count_class_lookup16[65536];
+static bool count_class_ready = false;
+
+static void init_count_class16(void){
+  for(uint32_t hi=0; hi<256; hi++){
+    for(uint32_t lo=0; lo<256; lo++){
+      count_class_lookup16[(hi << 8) | lo] = (uint16_t)((count_class_lookup8[hi] << 8) | count_class_lookup8[lo]);
+    }
+  }
+  count_class_ready = true;
+}
+
+void coverage_classify(uint8_t* map, size_t size){
+  if(!count_class_ready) init_count_class16();
+  size_t i = 0;
+  for(; i + 8 <= size; i += 8){
+    uint64_t word;
+    memcpy(&word, map + i, 8);
+    if(!word) continue;
+    uint16_t half[4];
+    memcpy(half, &word, 8);
+    for(int k=0; k<4; k++) half[k] = count_class_lookup16[half[k]];
+    memcpy(map + i, half, 8);
+  }
+  for(; i<size; i++) map[i] = count_class_lookup8[map[i]];
+}
+
 void coverage_init_shared() {
     if (vm_coverage_map != NULL) return;  // Already initialized
     
@@ -45,11 +235,7 @@ void asm_coverage_write(const char* path){
 }
 
 uint32_t asm_coverage_count_bits(){
-  uint32_t count = 0;
-  for(int i=0; i< ASM_COVERAGE_MAP_SIZE; i++){
-    if(asm_coverage_map[i] > 0) count ++;
-  }
-  return count;
+  return coverage_count_nonzero(asm_coverage_map, ASM_COVERAGE_MAP_SIZE);
 }
 
 
@@ -66,11 +252,130 @@ void vm_coverage_write(const char* path){
 }
 
 uint32_t vm_coverage_count_bits(){
-  uint32_t count = 0;
-  for(int i=0; i< VM_COVERAGE_MAP_SIZE; i++){
-    if(vm_coverage_map[i] > 0) count ++;
+  return coverage_count_nonzero(vm_coverage_map, VM_COVERAGE_MAP_SIZE);
+}
+
+void edge_map_reset(EdgeMap* m){
+  if(m->overflow){
+    memset(m->hits, 0, EDGE_MAP_SIZE);
+  } else {
+    for(uint32_t i=0; i<m->touched_count; i++) m->hits[m->touched[i]] = 0;
   }
-  return count;
+  m->touched_count = 0;
+  m->overflow = 0;
+  m->prev_loc = 0;
+}
+
+void edge_map_classify(EdgeMap* m){
+  if(m->overflow){
+    coverage_classify(m->hits, EDGE_MAP_SIZE);
+    return;
+  }
+  for(uint32_t i=0; i<m->touched_count; i++){
+    uint32_t edge = m->touched[i];
+    m->hits[edge] = count_class_lookup8[m->hits[edge]];
+  }
+}
+
+uint32_t edge_map_merge(const EdgeMap* m, uint8_t* virgin, uint32_t* new_buckets){
+  if(m->overflow) return coverage_merge_virgin(m->hits, virgin, EDGE_MAP_SIZE, new_buckets);
+  uint32_t fresh = 0;
+  for(uint32_t i=0; i<m->touched_count; i++){
+    uint32_t edge = m->touched[i];
+    uint8_t h = m->hits[edge], v = virgin[edge];
+    if(!(h & v)) continue;
+    if(v == 0xFF) fresh++;
+    else (*new_buckets)++;
+    virgin[edge] = v & ~h;
+  }
+  return fresh;
+}
+
+#ifdef COVERAGE_BENCH
+//gcc -O2 -DCOVERAGE_BENCH coverage.c -o coverage_bench
+#include<time.h>
+
+static double bench_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct BenchKernel{
+  const char* name;
+  uint32_t (*count)(const uint8_t*, size_t);
+  uint32_t (*merge)(const uint8_t*, uint8_t*, size_t, uint32_t*);
+} BenchKernel;
+
+static void classify_bytewise(uint8_t* map, size_t size){
+  for(size_t i=0; i<size; i++) map[i] = count_class_lookup8[map[i]];
 }
 
+int main(void){
+  enum { ROUNDS = 20000 };
+  static uint8_t raw[EDGE_MAP_SIZE], hits[EDGE_MAP_SIZE], virgin[EDGE_MAP_SIZE], scratch[EDGE_MAP_SIZE];
+  BenchKernel kernels[3] = {{"scalar", count_nonzero_scalar, merge_virgin_scalar}};
+  int nkernels = 1;
+#ifdef COVERAGE_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2")) kernels[nkernels++] = (BenchKernel){"sse2", count_nonzero_sse2, merge_virgin_sse2};
+  if(__builtin_cpu_supports("avx2")) kernels[nkernels++] = (BenchKernel){"avx2", count_nonzero_avx2, merge_virgin_avx2};
+#endif
+
+  //a few hundred edges per run is what the fuzzers see, 16K is a worst case
+  int densities[2] = {300, 16384};
+  srand(1);
+  for(int d=0; d<2; d++){
+    memset(raw, 0, sizeof(raw));
+    memset(virgin, 0xFF, sizeof(virgin));
+    for(int i=0; i<densities[d]; i++) raw[rand() % EDGE_MAP_SIZE] = (uint8_t)(1 + rand() % 255);
+    //half the map already seen at some buckets
+    for(int i=0; i<EDGE_MAP_SIZE; i++) if(rand() % 2) virgin[i] = (uint8_t)rand();
 
+    printf("%d edges hit:\n", densities[d]);
+    double t0 = bench_now();
+    for(int r=0; r<ROUNDS; r++){
+      memcpy(hits, raw, EDGE_MAP_SIZE);
+      classify_bytewise(hits, EDGE_MAP_SIZE);
+    }
+    double t1 = bench_now();
+    for(int r=0; r<ROUNDS; r++){
+      memcpy(hits, raw, EDGE_MAP_SIZE);
+      coverage_classify(hits, EDGE_MAP_SIZE);
+    }
+    double t2 = bench_now();
+    memcpy(scratch, raw, EDGE_MAP_SIZE);
+    classify_bytewise(scratch, EDGE_MAP_SIZE);
+    printf("  classify bytewise %7.2f us  lookup16 %7.2f us  %s\n", (t1 - t0) * 1e6 / ROUNDS, (t2 - t1) * 1e6 / ROUNDS,
+           memcmp(scratch, hits, EDGE_MAP_SIZE) ? "MISMATCH" : "ok");
+
+    uint32_t want_count = 0, want_fresh = 0, want_buckets = 0;
+    for(int k=0; k<nkernels; k++){
+      uint32_t got_count = 0, got_fresh = 0, got_buckets = 0;
+      double t0 = bench_now();
+      for(int r=0; r<ROUNDS; r++) got_count += kernels[k].count(hits, EDGE_MAP_SIZE);
+      double t1 = bench_now();
+      for(int r=0; r<ROUNDS; r++){
+        memcpy(scratch, virgin, EDGE_MAP_SIZE);
+        got_fresh += kernels[k].merge(hits, scratch, EDGE_MAP_SIZE, &got_buckets);
+      }
+      double t2 = bench_now();
+      //the copy is timed separately so it can be taken out of the merge figure
+      for(int r=0; r<ROUNDS; r++){
+        memcpy(scratch, virgin, EDGE_MAP_SIZE);
+        __asm__ volatile("" ::: "memory");
+      }
+      double t3 = bench_now();
+      if(k == 0){
+        want_count = got_count;
+        want_fresh = got_fresh;
+        want_buckets = got_buckets;
+      }
+      printf("  %-6s count %7.2f us  merge %7.2f us  %s\n", kernels[k].name,
+             (t1 - t0) * 1e6 / ROUNDS, ((t2 - t1) - (t3 - t2)) * 1e6 / ROUNDS,
+             (got_count == want_count && got_fresh == want_fresh && got_buckets == want_buckets) ? "ok" : "MISMATCH");
+    }
+  }
+  return 0;
+}
+#endif
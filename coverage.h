@@ -7,11 +7,14 @@
 #include<ctype.h>
 #include<limits.h>
 #include<stdint.h>
+#include<stdbool.h>
 
 //Coverage-related
 
-#define VM_COVERAGE_MAP_SIZE 65536
-#define ASM_COVERAGE_MAP_SIZE 65536
+#define EDGE_MAP_SIZE 65536
+#define VM_COVERAGE_MAP_SIZE EDGE_MAP_SIZE
+#define ASM_COVERAGE_MAP_SIZE EDGE_MAP_SIZE
+#define MAX_TOUCHED_EDGES 4096
 
 extern uint8_t *vm_coverage_map;
 extern uint8_t *asm_coverage_map;
@@ -39,6 +42,98 @@ static inline void record_asm(uint32_t loc){
   __prev_asm_loc = loc >> 1;
 }
 
+//shared map used by the fuzzers. a slot going 0 -> 1 is also appended to touched[], so clearing a run
+//and diffing it against the virgin map costs O(edges hit) instead of O(map size)
+typedef struct EdgeMap{
+  uint8_t hits[EDGE_MAP_SIZE];
+  uint32_t touched[MAX_TOUCHED_EDGES];
+  uint32_t touched_count;
+  uint32_t overflow; //touched[] filled up or can't be trusted (child killed mid-update), use whole-map passes
+  uint32_t prev_loc;
+} EdgeMap;
+
+static inline void edge_map_hit(EdgeMap* m, uint32_t edge){
+  uint8_t *slot = &m->hits[edge];
+  if(*slot == 0){
+    if(m->touched_count < MAX_TOUCHED_EDGES) m->touched[m->touched_count++] = edge;
+    else m->overflow = 1;
+  }
+  if(*slot < 255) (*slot)++;
+}
+
+//presence only, the slot stays at 1 however often the edge runs
+static inline void edge_map_mark(EdgeMap* m, uint32_t edge){
+  if(m->hits[edge]) return;
+  if(m->touched_count < MAX_TOUCHED_EDGES) m->touched[m->touched_count++] = edge;
+  else m->overflow = 1;
+  m->hits[edge] = 1;
+}
+
+//edge from the previous location to loc, advances prev_loc
+static inline uint32_t edge_map_next(EdgeMap* m, uint32_t loc){
+  uint32_t edge = hash_edge(m->prev_loc, loc) % EDGE_MAP_SIZE;
+  m->prev_loc = loc >> 1;
+  return edge;
+}
+
+static inline void edge_map_record(EdgeMap* m, uint32_t loc){
+  edge_map_hit(m, edge_map_next(m, loc));
+}
+
+//direct-indexed VM edges: (prev ip + 1, ip) is a cell of a DIRECT_EDGE_STRIDE-wide matrix, no hashing and
+//no collisions for programs up to the stride (the assembler stops at 100 lines). 16K map bytes at most
+#define DIRECT_EDGE_STRIDE 128
+
+//ctx is the VM's call context folded into the cell, 0 (no CALL active) keeps the exact matrix index
+static inline uint32_t edge_map_next_direct(EdgeMap* m, uint32_t ip, uint32_t ctx){
+  uint32_t edge = ((m->prev_loc * DIRECT_EDGE_STRIDE + ip) ^ ctx) % EDGE_MAP_SIZE;
+  m->prev_loc = ip + 1;
+  return edge;
+}
+
+static inline void edge_map_record_direct(EdgeMap* m, uint32_t ip){
+  edge_map_hit(m, edge_map_next_direct(m, ip, 0));
+}
+
+static inline void edge_map_record_direct_ctx(EdgeMap* m, uint32_t ip, uint32_t ctx){
+  edge_map_hit(m, edge_map_next_direct(m, ip, ctx));
+}
+
+//operands of every CMP (fused CMP_Jcc included) in execution order, for comparison-guided mutation
+#define CMPLOG_SIZE 256
+
+typedef struct CmpLogEntry{
+  uint32_t ip;
+  int32_t a;
+  int32_t b;
+} CmpLogEntry;
+
+typedef struct CmpLog{
+  uint32_t count; //keeps counting past CMPLOG_SIZE, only the first CMPLOG_SIZE are stored
+  CmpLogEntry entries[CMPLOG_SIZE];
+} CmpLog;
+
+//where the instrumented vm_run variants (vm_run_edges, vm_run_hits, vm_run_cmplog) record, hung off VM.cov.
+//VM edges follow the direct/context rules above, asm edges hash (opcode << 16 | ip)
+typedef struct VMCoverage{
+  EdgeMap *vm_map;
+  EdgeMap *asm_map;
+  CmpLog *cmp_log; //vm_run_cmplog only
+  bool direct; //direct-index VM edges when the program fits DIRECT_EDGE_STRIDE
+  uint32_t ctx_mask; //~0u mixes VM.call_ctx into VM edges, 0 leaves it out
+} VMCoverage;
+
+//whole-map kernels, SSE2/AVX2 picked at runtime on x86
+uint32_t coverage_count_nonzero(const uint8_t* map, size_t size);
+uint32_t coverage_merge_virgin(const uint8_t* hits, uint8_t* virgin, size_t size, uint32_t* new_buckets); //same contract as edge_map_merge
+void coverage_classify(uint8_t* map, size_t size); //raw hit counts -> one bucket bit per byte
+
+void edge_map_reset(EdgeMap* m);
+void edge_map_classify(EdgeMap* m); //turns hit counts into bucket bits, call once per run before merging
+//clears the run's bucket bits from virgin. returns edges never seen before, known edges that reached a new
+//bucket are added to *new_buckets
+uint32_t edge_map_merge(const EdgeMap* m, uint8_t* virgin, uint32_t* new_buckets);
+
 void vm_coverage_reset();
 void vm_coverage_write(const char* path);
 uint32_t vm_coverage_count_bits();
@@ -3,7 +3,7 @@
 #include"error.h"
 #include"fuzzers/rl_bridge/state.h"
 
-void report_vm_error(Errors err, int pc, 
+void print_vm_error(Errors err, int pc, 
                      const char* instr, const char* detail){
 fprintf(stderr, 
 "{"
@@ -15,10 +15,9 @@ fprintf(stderr,
         "}\n",
     err, pc, instr, detail
         );
-  exit(err);
 }
 
-void report_asm_error(Errors err, int pc, 
+void print_asm_error(Errors err, int pc, 
                       const char* token, const char* detail){
 
   fprintf(stderr, 
@@ -31,8 +30,19 @@ void report_asm_error(Errors err, int pc,
         "}\n",
     err, pc, token, detail
         );
+
+}
+
+void report_vm_error(Errors err, int pc, 
+                     const char* instr, const char* detail){
+  print_vm_error(err, pc, instr, detail);
   exit(err);
+}
 
+void report_asm_error(Errors err, int pc, 
+                      const char* token, const char* detail){
+  print_asm_error(err, pc, token, detail);
+  exit(err);
 }
 
 //test 
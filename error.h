@@ -49,6 +49,9 @@ typedef enum {
     ERR_COUNT
 } Errors;
 
+//print_* only write the JSON line to stderr, report_* also exit with err
+void print_vm_error(Errors err, int pc, const char* instr, const char* detail);
+void print_asm_error(Errors err, int pc, const char* token, const char* detail);
 void report_vm_error(Errors err, int pc, const char* instr, const char* detail)  __attribute__((noreturn));
 void report_asm_error(Errors err, int pc, const char* token, const char* detail)  __attribute__((noreturn));
 
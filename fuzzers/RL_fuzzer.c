@@ -16,15 +16,20 @@
 #include "../coverage.h"
 #include "../header.h"
 #include "../error.h"
+#include "../reg_vm.h"
+#include "../verify.h"
+#include "../optimize.h"
 #include "rl_bridge/state.h"
 #include "rl_bridge/rl_comm.h"
 #include "fuzzer_util.h"
+#include "fork_server.h"
+#include "exec_cache.h"
 
 // ================= CONFIGURATION =================
 
 #define MAX_ITERATIONS 30000
-#define TIMEOUT_SECONDS 5
-#define TEMP_INPUT_FILE "fuzz_input.txt"
+#define TIMEOUT_MS 5000
+#define MAX_INPUT_SIZE (1 << 20)  // largest test case the shared input region holds
 #define CRASHES_DIR "crashes"
 #define CORPUS_DIR "corpus"
 #define STATS_FILE "fuzz_stats.txt"
@@ -35,19 +40,42 @@
 #define MAX_CORPUS 512
 #define MAX_CORPUS_PATH 512
 #define NUM_MUTATION_PER_RUN 3
+#define VM_ENGINE vm_run_hits  // vm_run_edges: presence only, vm_run_cmplog: also logs CMP operands, vm_run_plain: no coverage
+#define INLINE_VM_COVERAGE 1  // 0: record through trace_step instead, for vm_run, vm_run_indirect and vm_run_bytecode
+#define BLOCK_VM_COVERAGE 0  // 1: run vm_run_regs, VM edges go between basic blocks and MAXSTEPS is checked per block
+#define FUSE_SUPERINSTRUCTIONS 0  // fused sequences trace once, so VM edge coverage gets coarser
+#define VERIFY_STACK 1  // run instructions whose stack/callstack checks are proven unnecessary unchecked
+#define OPTIMIZE_PASSES 0  // OPT_* passes from optimize.h, VM edges then follow the optimized ips instead of the source lines
+#define DIRECT_VM_COVERAGE 1  // 0: hash (prev ip, ip) into the VM map like the asm edges
+#define CONTEXT_VM_COVERAGE 0  // 1: mix the CALL chain into VM edges, same code reached from new call paths counts
+#define USE_FORK_SERVER 1  // 0: fork the whole fuzzer for every test case
+#define PERSISTENT_ITERATIONS 1000  // test cases one fork server child runs in-process before it is replaced
+#define USE_EXEC_CACHE 1  // replay the stored run when an identical assembled program already ran
 
 // ================= DATA STRUCTURES =================
 
 typedef struct {
-    uint8_t vm_coverage[VM_COVERAGE_MAP_SIZE];
-    uint8_t asm_coverage[ASM_COVERAGE_MAP_SIZE];
-    uint32_t prev_vm_loc;
-    uint32_t prev_asm_loc;
+    EdgeMap vm_map;
+    EdgeMap asm_map;
+    CmpLog cmp_log;
     Errors result_code;
-    uint32_t step_count;
+    uint32_t step_count; // published once the run is over
 } SharedCoverageData;
 
 static SharedCoverageData* shared_cov = NULL;
+static VMCoverage vm_cov; // hands the shared maps to the instrumented vm_run variants
+
+// the current test case, written by the parent and read in place by the child, no file in between
+typedef struct {
+    size_t length;
+    char data[MAX_INPUT_SIZE];
+} SharedInput;
+
+static SharedInput* shared_input = NULL;
+
+#if USE_FORK_SERVER
+static ForkServer fork_server;
+#endif
 
 typedef enum {
     TIER_SAFE = 0,
@@ -83,43 +111,38 @@ static void init_asm_virgin(void) {
     memset(asm_virgin_map, 0xFF, ASM_COVERAGE_MAP_SIZE);
 }
 
-static void record_vm_edge(uint32_t loc) {
-    uint32_t edge = hash_edge(shared_cov->prev_vm_loc, loc) % VM_COVERAGE_MAP_SIZE;
-    uint8_t *slot = &shared_cov->vm_coverage[edge];
-    if (*slot < 255) (*slot)++;
-    shared_cov->prev_vm_loc = loc >> 1;
+static void record_vm_edge(const VM* vm) {
+    uint32_t loc = (uint32_t)vm->ip;
+    uint32_t ctx = CONTEXT_VM_COVERAGE ? vm->call_ctx : 0;
+    if (DIRECT_VM_COVERAGE && vm->program_size <= DIRECT_EDGE_STRIDE) {
+        edge_map_record_direct_ctx(&shared_cov->vm_map, loc, ctx);
+    } else {
+        edge_map_record(&shared_cov->vm_map, loc ^ ctx);
+    }
 }
 
 static void record_asm_edge(uint32_t opcode, uint32_t line) {
     uint32_t loc = (opcode << 16) | (line & 0xFFFF);
-    uint32_t edge = hash_edge(shared_cov->prev_asm_loc, loc) % ASM_COVERAGE_MAP_SIZE;
-    uint8_t *slot = &shared_cov->asm_coverage[edge];
-    if (*slot < 255) (*slot)++;
-    shared_cov->prev_asm_loc = loc >> 1;
+    edge_map_record(&shared_cov->asm_map, loc);
+}
+
+static void trace_step(VM* vm, const Instr* instr) {
+    record_vm_edge(vm);
+    record_asm_edge((uint32_t)instr->ID, (uint32_t)vm->ip);
 }
 
 typedef struct {
     uint32_t vm_new;
     uint32_t asm_new;
+    uint32_t new_buckets; // known edges hit a hit-count bucket they never reached before
 } CoverageResult;
 
 static CoverageResult process_coverage(void) {
-    CoverageResult result = {0, 0};
-    
-    for (size_t i = 0; i < VM_COVERAGE_MAP_SIZE; i++) {
-        if (shared_cov->vm_coverage[i] > 0 && vm_virgin_map[i] == 0xFF) {
-            vm_virgin_map[i] = 0;
-            result.vm_new++;
-        }
-    }
-
-    for (size_t i = 0; i < ASM_COVERAGE_MAP_SIZE; i++) {
-        if (shared_cov->asm_coverage[i] > 0 && asm_virgin_map[i] == 0xFF) {
-            asm_virgin_map[i] = 0;
-            result.asm_new++;
-        }
-    }
-    
+    CoverageResult result = {0, 0, 0};
+    edge_map_classify(&shared_cov->vm_map);
+    edge_map_classify(&shared_cov->asm_map);
+    result.vm_new = edge_map_merge(&shared_cov->vm_map, vm_virgin_map, &result.new_buckets);
+    result.asm_new = edge_map_merge(&shared_cov->asm_map, asm_virgin_map, &result.new_buckets);
     return result;
 }
 
@@ -144,6 +167,8 @@ typedef struct {
     int register_errors;
     uint64_t start_time;
     uint64_t total_exec_time_ms;
+    uint64_t total_vm_steps;
+    int cached_runs;
 } FuzzStats;
 
 static inline uint32_t total_new_cov(FuzzStats* stats) {
@@ -244,7 +269,10 @@ static inline float coverage_per_success(uint32_t cov, uint32_t success) {
 
 
 static bool write_test_case(Buffer* buf) {
-    return file_write(TEMP_INPUT_FILE, buf->data, buf->length);
+    if (buf->length > MAX_INPUT_SIZE) return false;
+    memcpy(shared_input->data, buf->data, buf->length);
+    shared_input->length = buf->length;
+    return true;
 }
 
 static void save_crash(Buffer* buf, const char* reason, int signal, FuzzStats* stats) {
@@ -271,7 +299,7 @@ static void save_hang(Buffer* buf, FuzzStats* stats) {
     
     FILE* f = fopen(filename, "w");
     if (f) {
-        fprintf(f, "; Program timeout after %d seconds\n", TIMEOUT_SECONDS);
+        fprintf(f, "; Program timeout after %d ms\n", TIMEOUT_MS);
         fprintf(f, "; Total runs: %d\n\n", stats->total_runs);
         fwrite(buf->data, 1, buf->length, f);
         fclose(f);
@@ -490,194 +518,309 @@ static void apply_mutation_tier(Buffer *buf, int tier, int mutation_idx) {
     list[mutation_idx](buf);
 }
 
-static Errors run_single_test(Buffer* test_input, FuzzStats* stats, CoverageResult* cov_result) {
-    stats->total_runs++;
+// assembles and runs shared_input without exiting, every allocation is released before returning
+static Errors execute_input(void) {
+    AsmResult asm_result;
+    bool assembled = assemble_buffer(shared_input->data, shared_input->length, &asm_result);
+    if (!assembled) {
+        print_asm_error(asm_result.error, asm_result.line,
+                        asm_result.has_token ? asm_result.token : NULL, asm_result.detail);
+        return asm_result.error;
+    }
     
-    cov_result->vm_new = 0;
-    cov_result->asm_new = 0;
+    Instr* program = asm_result.program;
+    int program_size = asm_result.program_size;
+    Label* labels = asm_result.labels;
+    int label_count = asm_result.label_count;
     
-    if (!write_test_case(test_input)) {
-        fprintf(stderr, "Failed to write test case\n");
-        return ERR_IO;
+    if (!program || program_size == 0) {
+        free_program(program, program_size);
+        free(labels);
+        return ERR_EMPTY_PROGRAM;
     }
     
-    memset(shared_cov->vm_coverage, 0, VM_COVERAGE_MAP_SIZE);
-    memset(shared_cov->asm_coverage, 0, ASM_COVERAGE_MAP_SIZE);
-    shared_cov->prev_vm_loc = 0;
-    shared_cov->prev_asm_loc = 0;
-    shared_cov->step_count = 0;
-    shared_cov->result_code = ERR_OK;
+    for (int i = 0; i < program_size; i++) {
+        record_asm_edge((uint32_t)program[i].ID, (uint32_t)i);
+    }
+    
+    if (OPTIMIZE_PASSES) {
+        optimize_program(&program, &program_size, labels, label_count, OPTIMIZE_PASSES);
+    }
+    if (FUSE_SUPERINSTRUCTIONS) {
+        fuse_program(program, program_size);
+    }
+    if (VERIFY_STACK) {
+        verify_program(program, program_size, NULL);
+    }
+    
+    BytecodeProgram bytecode;
+    Errors emitted = emit_bytecode(program, program_size, &bytecode);
+    if (emitted != ERR_OK) {
+        print_asm_error(emitted, 0, NULL, emitted == ERR_ALLOC_FAIL ? "Bytecode emission failed" : "Program doesn't fit the bytecode encoding");
+        free_program(program, program_size);
+        free(labels);
+        return emitted;
+    }
+    
+    VM vm;
+    vm_init(&vm, program, program_size);
+    vm.bytecode = &bytecode;
+    vm.cov = &vm_cov;
+    vm.lb = label_count;
     
+    if (labels && label_count > 0) {
+        memcpy(vm.labels, labels, (size_t)label_count * sizeof(Label));
+    }
+    
+#if BLOCK_VM_COVERAGE
+    RegProgram regprog;
+    if (!reg_translate(program, program_size, &regprog)) {
+        print_asm_error(ERR_ALLOC_FAIL, 0, NULL, "Register translation failed");
+        vm_free(&vm);
+        free_bytecode(&bytecode);
+        free_program(program, program_size);
+        free(labels);
+        return ERR_ALLOC_FAIL;
+    }
+    vm.regprog = &regprog;
+    vm_run_guarded(&vm, vm_run_regs, INLINE_VM_COVERAGE ? NULL : trace_step);
+    reg_free(&regprog);
+#else
+    vm_run_guarded(&vm, VM_ENGINE, INLINE_VM_COVERAGE ? NULL : trace_step);
+#endif
+    shared_cov->step_count = (uint32_t)vm.stepcount;
+    if (vm.error != ERR_OK) {
+        print_vm_error(vm.error, vm.error_ip, vm.error_instr, vm.error_detail);
+    } else if (current_state) {
+        current_state->numeric_features[6] = (float)vm.stepcount;
+    }
+    
+    vm_free(&vm);
+    free_bytecode(&bytecode);
+    free_program(program, program_size);
+    free(labels);
+    return vm.error;
+}
+
+// runs in the forked child. with the fork server it keeps going in-process until PERSISTENT_ITERATIONS,
+// handing back each result through shared_cov, and exits with the last one
+static void run_target(void) {
+    FILE* err_log = fopen("fuzz_stderr.log", "w");
+    if (err_log) {
+        dup2(fileno(err_log), STDERR_FILENO);
+        fclose(err_log);
+    }
+    
+    for (int n = 1; ; n++) {
+        Errors result = execute_input();
+        if (!USE_FORK_SERVER || n >= PERSISTENT_ITERATIONS) {
+            exit(result);
+        }
+        shared_cov->result_code = result;
+        fork_server_yield();
+    }
+}
+
+#if !USE_FORK_SERVER
+static bool run_forked(int* status, bool* timed_out) {
+    *timed_out = false;
+    fflush(NULL);
     pid_t pid = fork();
     
     if (pid == -1) {
         perror("fork");
-        return ERR_UNKNOWN;
+        return false;
     }
     
     if (pid == 0) {
-        // ==================== CHILD PROCESS ====================
-        
-        FILE* err_log = fopen("fuzz_stderr.log", "w");
-        if (err_log) {
-            dup2(fileno(err_log), STDERR_FILENO);
-            fclose(err_log);
+        run_target();
+    }
+
+    if (!wait_child(pid, TIMEOUT_MS, status, timed_out)) {
+        perror("waitpid");
+        return false;
+    }
+    return true;
+}
+#endif
+
+#if USE_EXEC_CACHE
+static ExecCache exec_cache;
+
+// assembles in the parent to look the run up by its program. NULL means it has to run: either a miss, with
+// *cacheable set so the result gets stored under that program, or a source that doesn't assemble, left to the child to report
+static const ExecCacheEntry* lookup_cached_run(const Buffer* input, bool* cacheable) {
+    AsmResult asm_result;
+    *cacheable = false;
+    State* state = current_state;
+    current_state = NULL; // the parent's assembly must not count towards the RL state
+    bool assembled = assemble_buffer(input->data, input->length, &asm_result);
+    current_state = state;
+    if (!assembled) return NULL;
+
+    const ExecCacheEntry* cached = NULL;
+    BytecodeProgram bytecode;
+    if (asm_result.program_size > 0 && emit_bytecode(asm_result.program, asm_result.program_size, &bytecode) == ERR_OK) {
+        cached = exec_cache_lookup(&exec_cache, &bytecode);
+        *cacheable = (cached == NULL);
+        free_bytecode(&bytecode);
+    }
+    if (cached && current_state) {
+        // the child would have filled these while assembling and running
+        state_update_histogram(current_state, asm_result.program_size, asm_result.program);
+        state_update_num_features(current_state, asm_result.program_size, asm_result.program);
+        if (cached->result_code == ERR_OK) {
+            current_state->numeric_features[6] = (float)cached->step_count;
         }
-        
-        Instr* program = NULL;
-        int program_size = 0;
-        Label* labels = NULL;
-        int label_count = 0;
-        
-        define_program(&program, &program_size, &labels, &label_count);
-        
-        if (!program || program_size == 0) {
-            exit(ERR_EMPTY_PROGRAM);
+    }
+
+    free_program(asm_result.program, asm_result.program_size);
+    free(asm_result.labels);
+    return cached;
+}
+#endif
+
+// starts the child on the test case in shared_input and waits for it. false if no child could be run
+static bool launch_test(int* status, bool* timed_out) {
+#if USE_FORK_SERVER
+    if (!fork_server_run(&fork_server, TIMEOUT_MS, status, timed_out)) {
+        // server died underneath us, bring up a new one and retry once
+        fork_server_stop(&fork_server);
+        if (!fork_server_start(&fork_server, run_target) ||
+            !fork_server_run(&fork_server, TIMEOUT_MS, status, timed_out)) {
+            fprintf(stderr, "fork server unavailable\n");
+            return false;
         }
-        
-        for (int i = 0; i < program_size; i++) {
-            record_asm_edge((uint32_t)program[i].ID, (uint32_t)i);
+    }
+    return true;
+#else
+    return run_forked(status, timed_out);
+#endif
+}
+
+static Errors run_single_test(Buffer* test_input, FuzzStats* stats, CoverageResult* cov_result) {
+    stats->total_runs++;
+    
+    cov_result->vm_new = 0;
+    cov_result->asm_new = 0;
+    cov_result->new_buckets = 0;
+    
+    edge_map_reset(&shared_cov->vm_map);
+    edge_map_reset(&shared_cov->asm_map);
+    shared_cov->step_count = 0;
+    shared_cov->cmp_log.count = 0;
+    shared_cov->result_code = ERR_OK;
+    
+    int status = 0;
+    bool timed_out = false;
+    bool replayed = false;
+#if USE_EXEC_CACHE
+    bool cacheable = false;
+    const ExecCacheEntry* cached = lookup_cached_run(test_input, &cacheable);
+    if (cached) {
+        exec_cache_replay(cached, &shared_cov->vm_map, &shared_cov->asm_map);
+        shared_cov->step_count = cached->step_count;
+        shared_cov->result_code = cached->result_code;
+        stats->cached_runs++;
+        replayed = true;
+    }
+#endif
+
+    if (!replayed) {
+        if (!write_test_case(test_input)) {
+            fprintf(stderr, "Failed to write test case\n");
+            return ERR_IO;
         }
-        
-        VM vm;
-        memset(&vm, 0, sizeof(VM));
-        vm.call_sp = -1;
-        vm.stepcount = 0;
-        vm.lb = label_count;
-        vm.sp = -1;
-        vm.ip = 0;
-        vm.running = true;
-        vm.program = program;
-        
-        if (label_count > MAXLABELS) {
-            report_vm_error(ERR_TOO_MANY_LABELS, 0, NULL, "Too many labels");
+        if (!launch_test(&status, &timed_out)) {
+            return ERR_UNKNOWN;
         }
+    }
+
+    // a child killed between bumping a slot and listing it leaves the touched lists short
+    if (WIFSIGNALED(status)) {
+        shared_cov->vm_map.overflow = 1;
+        shared_cov->asm_map.overflow = 1;
+    }
+
+    if (timed_out) {
+        *cov_result = process_coverage();
+        stats->vm_new_cov += cov_result->vm_new;
+        stats->asm_new_cov += cov_result->asm_new;
         
-        if (labels && label_count > 0) {
-            memcpy(vm.labels, labels, (size_t)label_count * sizeof(Label));
+        stats->hangs++;
+        save_hang(test_input, stats);
+        return ERR_TIMEOUT;
+    }
+
+    // stopped: a persistent child finished this test case and left its result in shared_cov, same for a replay
+    if (replayed || WIFEXITED(status) || WIFSTOPPED(status)) {
+        int exit_code = (replayed || WIFSTOPPED(status)) ? (int)shared_cov->result_code : WEXITSTATUS(status);
+#if USE_EXEC_CACHE
+        // stored before process_coverage classifies the maps in place
+        if (cacheable) {
+            exec_cache_store(&exec_cache, (Errors)exit_code, shared_cov->step_count,
+                             &shared_cov->vm_map, &shared_cov->asm_map);
         }
-        
-        while (vm.running) {
-            if (vm.ip < 0 || vm.ip >= program_size) {
-                report_vm_error(ERR_PC_OUT_OF_BOUNDS, vm.ip, "index", 
-                               "Instruction pointer out of bounds");
+#endif
+        stats->total_vm_steps += shared_cov->step_count;
+
+        if (exit_code != ERR_OK && exit_code < ERR_COUNT) {
+            if (is_asm_error((Errors)exit_code)) {
+                state_update_asm_error(current_state, (Errors)exit_code);
+            } else if (is_vm_error((Errors)exit_code)) {
+                state_update_vm_error(current_state, (Errors)exit_code);
             }
-            
-            const Instr* instr = &vm.program[vm.ip];
-            
-            record_vm_edge((uint32_t)vm.ip);
-            record_asm_edge((uint32_t)instr->ID, (uint32_t)vm.ip);
-            
-            vm.ip++;
-            instr->execute(&vm, instr);
+        }
+        
+        *cov_result = process_coverage();
+        
+        stats->vm_new_cov += cov_result->vm_new;
+        stats->asm_new_cov += cov_result->asm_new;
 
-            vm.stepcount++;
-            shared_cov->step_count = (uint32_t)vm.stepcount;
+        if (cov_result->vm_new > 0 || cov_result->asm_new > 0 || cov_result->new_buckets > 0) {
+            save_corpus(test_input, stats, stats->total_runs, 
+                       cov_result->vm_new, cov_result->asm_new);
             
-            if (vm.stepcount >= MAXSTEPS) {
-                report_vm_error(ERR_MAX_INSTRUCTIONS, vm.ip, NULL, 
-                               "Exceeded maximum instruction count");
+            if (cov_result->vm_new > 0) {
+                save_coverage_map(VM_COVERAGE_FILE, 
+                                 shared_cov->vm_map.hits, 
+                                 VM_COVERAGE_MAP_SIZE);
             }
-            
-            if (current_state) {
-                current_state->numeric_features[6] = (float)vm.stepcount;
+            if (cov_result->asm_new > 0) {
+                save_coverage_map(ASM_COVERAGE_FILE, 
+                                 shared_cov->asm_map.hits, 
+                                 ASM_COVERAGE_MAP_SIZE);
             }
         }
+
+        if (exit_code == ERR_OK) {
+            stats->successful_runs++;
+        } else {
+            categorize_error((Errors)exit_code, stats);
+        }
         
-        free_program(program, program_size);
-        if (labels) free(labels);
-        exit(ERR_OK);
+        return (Errors)exit_code;
     }
-
-    // ==================== PARENT PROCESS ====================
-    int status;
-    time_t start = time(NULL);
     
-    while (1) {
-        int result = waitpid(pid, &status, WNOHANG);
+    if (WIFSIGNALED(status)) {
+        int sig = WTERMSIG(status);
         
-        if (result == -1) {
-            perror("waitpid");
-            return ERR_UNKNOWN;
-        }
+        *cov_result = process_coverage();
+        stats->vm_new_cov += cov_result->vm_new;
+        stats->asm_new_cov += cov_result->asm_new;
         
-        if (result > 0) {
-            if (WIFEXITED(status)) {
-                int exit_code = WEXITSTATUS(status);
-
-                if (exit_code != ERR_OK && exit_code < ERR_COUNT) {
-                    if (is_asm_error((Errors)exit_code)) {
-                        state_update_asm_error(current_state, (Errors)exit_code);
-                    } else if (is_vm_error((Errors)exit_code)) {
-                        state_update_vm_error(current_state, (Errors)exit_code);
-                    }
-                }
-                
-                *cov_result = process_coverage();
-                
-                stats->vm_new_cov += cov_result->vm_new;
-                stats->asm_new_cov += cov_result->asm_new;
-
-                if (cov_result->vm_new > 0 || cov_result->asm_new > 0) {
-                    save_corpus(test_input, stats, stats->total_runs, 
-                               cov_result->vm_new, cov_result->asm_new);
-                    
-                    if (cov_result->vm_new > 0) {
-                        save_coverage_map(VM_COVERAGE_FILE, 
-                                         shared_cov->vm_coverage, 
-                                         VM_COVERAGE_MAP_SIZE);
-                    }
-                    if (cov_result->asm_new > 0) {
-                        save_coverage_map(ASM_COVERAGE_FILE, 
-                                         shared_cov->asm_coverage, 
-                                         ASM_COVERAGE_MAP_SIZE);
-                    }
-                }
-
-                if (exit_code == ERR_OK) {
-                    stats->successful_runs++;
-                } else {
-                    categorize_error((Errors)exit_code, stats);
-                }
-                
-                return (Errors)exit_code;
-            }
-            
-            if (WIFSIGNALED(status)) {
-                int sig = WTERMSIG(status);
-                
-                *cov_result = process_coverage();
-                stats->vm_new_cov += cov_result->vm_new;
-                stats->asm_new_cov += cov_result->asm_new;
-                
-                stats->crashes++;
-                save_crash(test_input, "Signal", sig, stats);
-                
-                if (cov_result->vm_new > 0 || cov_result->asm_new > 0) {
-                    save_corpus(test_input, stats, stats->total_runs,
-                               cov_result->vm_new, cov_result->asm_new);
-                }
-                
-                return ERR_UNKNOWN;
-            }
-        }
-
-        if (difftime(time(NULL), start) >= TIMEOUT_SECONDS) {
-            kill(pid, SIGKILL);
-            waitpid(pid, &status, 0);
-            
-            *cov_result = process_coverage();
-            stats->vm_new_cov += cov_result->vm_new;
-            stats->asm_new_cov += cov_result->asm_new;
-            
-            stats->hangs++;
-            save_hang(test_input, stats);
-            return ERR_TIMEOUT;
+        stats->crashes++;
+        save_crash(test_input, "Signal", sig, stats);
+        
+        if (cov_result->vm_new > 0 || cov_result->asm_new > 0 || cov_result->new_buckets > 0) {
+            save_corpus(test_input, stats, stats->total_runs,
+                       cov_result->vm_new, cov_result->asm_new);
         }
         
-        struct timespec ts = {0, 10 * 1000 * 1000};
-        nanosleep(&ts, NULL);
+        return ERR_UNKNOWN;
     }
+
+    return ERR_UNKNOWN;
 }
 
 // ================= REWARD COMPUTATION =================
@@ -722,11 +865,14 @@ static float compute_reward(Errors result, uint32_t vm_cov, uint32_t asm_cov, in
 static void print_stats(FuzzStats* stats) {
     double elapsed = (double)(time_now_ms() - stats->start_time) / 1000.0;
     double execs_per_sec = elapsed > 0 ? stats->total_runs / elapsed : 0;
+    double instrs_per_sec = elapsed > 0 ? stats->total_vm_steps / elapsed : 0;
     
     printf("\n========== FUZZING STATISTICS ==========\n");
     printf("Total runs:        %d\n", stats->total_runs);
     printf("Time elapsed:      %.2f seconds\n", elapsed);
     printf("Execs/sec:         %.2f\n", execs_per_sec);
+    printf("VM instrs/sec:     %.2f\n", instrs_per_sec);
+    printf("Cached runs:       %d\n", stats->cached_runs);
     printf("\n");
     printf("Successful:        %d (%.1f%%)\n", 
            stats->successful_runs, 
@@ -775,6 +921,7 @@ static void save_stats(FuzzStats* stats) {
     fprintf(f, "asm_errors: %d\n", stats->asm_errors);
     fprintf(f, "vm_errors: %d\n", stats->vm_errors);
     fprintf(f, "successful: %d\n", stats->successful_runs);
+    fprintf(f, "cached_runs: %d\n", stats->cached_runs);
     
     fclose(f);
 }
@@ -791,9 +938,6 @@ int main(int argc, char** argv) {
     memset(&stats, 0, sizeof(FuzzStats));
     stats.start_time = time_now_ms();
     
-    init_vm_virgin();
-    init_asm_virgin();
-    
     shared_cov = mmap(NULL, sizeof(SharedCoverageData),
                       PROT_READ | PROT_WRITE,
                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -802,6 +946,11 @@ int main(int argc, char** argv) {
         return 1;
     }
     memset(shared_cov, 0, sizeof(SharedCoverageData));
+    vm_cov.vm_map = &shared_cov->vm_map;
+    vm_cov.asm_map = &shared_cov->asm_map;
+    vm_cov.cmp_log = &shared_cov->cmp_log;
+    vm_cov.direct = DIRECT_VM_COVERAGE;
+    vm_cov.ctx_mask = CONTEXT_VM_COVERAGE ? ~0u : 0;
     
     current_state = mmap(NULL, sizeof(State), PROT_READ | PROT_WRITE, 
                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -811,6 +960,33 @@ int main(int argc, char** argv) {
         return 1;
     }
     state_init(current_state);
+
+    shared_input = mmap(NULL, sizeof(SharedInput), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared_input == MAP_FAILED) {
+        perror("mmap shared_input");
+        munmap(current_state, sizeof(State));
+        munmap(shared_cov, sizeof(SharedCoverageData));
+        return 1;
+    }
+    shared_input->length = 0;
+
+#if USE_EXEC_CACHE
+    if (!exec_cache_init(&exec_cache)) {
+        perror("exec cache");
+        return 1;
+    }
+#endif
+
+#if USE_FORK_SERVER
+    // forked before the virgin maps and corpus are touched, so each test case forks a small process
+    if (!fork_server_start(&fork_server, run_target)) {
+        return 1;
+    }
+#endif
+
+    init_vm_virgin();
+    init_asm_virgin();
     
     if (rl_comm_init("/home/shu/testing.sock") < 0) {
         fprintf(stderr, "Warning: Could not connect to RL agent, running without RL\n");
@@ -824,7 +1000,7 @@ int main(int argc, char** argv) {
     printf("🐛 Stack VM Fuzzer (Edge Coverage)\n");
     printf("===================================\n");
     printf("Max iterations: %d\n", max_iterations);
-    printf("Timeout: %d seconds\n", TIMEOUT_SECONDS);
+    printf("Timeout: %d ms\n", TIMEOUT_MS);
     printf("Crashes dir: %s/\n", CRASHES_DIR);
     printf("\n");
     
@@ -986,9 +1162,16 @@ int main(int argc, char** argv) {
     
     print_stats(&stats); 
     save_stats(&stats);
+#if USE_FORK_SERVER
+    fork_server_stop(&fork_server);
+#endif
+#if USE_EXEC_CACHE
+    exec_cache_free(&exec_cache);
+#endif
     rl_comm_close();
     munmap(current_state, sizeof(State));
     munmap(shared_cov, sizeof(SharedCoverageData));
+    munmap(shared_input, sizeof(SharedInput));
     
     return 0;
 }
@@ -0,0 +1,115 @@
+#include "exec_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIX(h, v) ((h) = ((h) ^ (uint64_t)(v)) * 0x100000001b3ull)
+
+bool exec_cache_init(ExecCache* cache) {
+    cache->slots = calloc(EXEC_CACHE_SLOTS, sizeof(ExecCacheEntry));
+    memset(&cache->pending, 0, sizeof(BytecodeProgram));
+    cache->pending_key = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    return cache->slots != NULL;
+}
+
+void exec_cache_free(ExecCache* cache) {
+    if (!cache->slots) return;
+    for (int i = 0; i < EXEC_CACHE_SLOTS; i++) {
+        free(cache->slots[i].edges);
+        free_bytecode(&cache->slots[i].program);
+    }
+    free_bytecode(&cache->pending);
+    free(cache->slots);
+    cache->slots = NULL;
+}
+
+// hash of the canonical bytecode encoding, never 0
+static uint64_t exec_cache_key(const BytecodeProgram* bc) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    MIX(h, bc->size);
+    for (int i = 0; i < bc->size; i++) {
+        MIX(h, bc->code[i]);
+    }
+    MIX(h, bc->const_count);
+    for (int i = 0; i < bc->const_count; i++) {
+        MIX(h, (uint32_t)bc->consts[i]);
+    }
+    return h ? h : 1;
+}
+
+static bool same_program(const BytecodeProgram* a, const BytecodeProgram* b) {
+    if (a->size != b->size || a->const_count != b->const_count) return false;
+    if (a->size > 0 && memcmp(a->code, b->code, sizeof(Bytecode) * (size_t)a->size) != 0) return false;
+    return a->const_count == 0 || memcmp(a->consts, b->consts, sizeof(int) * (size_t)a->const_count) == 0;
+}
+
+// left empty when out of memory, the run then just isn't stored
+static void copy_program(BytecodeProgram* dst, const BytecodeProgram* src) {
+    free_bytecode(dst);
+    dst->code = malloc(sizeof(Bytecode) * (size_t)src->size);
+    dst->consts = malloc(sizeof(int) * (size_t)(src->const_count + 1));
+    if (!dst->code || !dst->consts) {
+        free_bytecode(dst);
+        return;
+    }
+    memcpy(dst->code, src->code, sizeof(Bytecode) * (size_t)src->size);
+    memcpy(dst->consts, src->consts, sizeof(int) * (size_t)src->const_count);
+    dst->size = src->size;
+    dst->const_count = src->const_count;
+}
+
+const ExecCacheEntry* exec_cache_lookup(ExecCache* cache, const BytecodeProgram* bc) {
+    uint64_t key = exec_cache_key(bc);
+    ExecCacheEntry* e = &cache->slots[key % EXEC_CACHE_SLOTS];
+    // a colliding key is a miss, the run replaces the entry once stored
+    if (e->key == key && same_program(&e->program, bc)) {
+        cache->hits++;
+        return e;
+    }
+    cache->misses++;
+    copy_program(&cache->pending, bc);
+    cache->pending_key = key;
+    return NULL;
+}
+
+static uint32_t pack_edges(const EdgeMap* m, uint32_t* out) {
+    for (uint32_t i = 0; i < m->touched_count; i++) {
+        uint32_t edge = m->touched[i];
+        out[i] = (edge << 8) | m->hits[edge];
+    }
+    return m->touched_count;
+}
+
+void exec_cache_store(ExecCache* cache, Errors result_code, uint32_t step_count,
+                      const EdgeMap* vm_map, const EdgeMap* asm_map) {
+    if (!cache->pending.code || vm_map->overflow || asm_map->overflow) return;
+
+    uint32_t* edges = malloc(sizeof(uint32_t) * (vm_map->touched_count + asm_map->touched_count + 1));
+    if (!edges) return;
+
+    ExecCacheEntry* e = &cache->slots[cache->pending_key % EXEC_CACHE_SLOTS];
+    free(e->edges);
+    free_bytecode(&e->program);
+    e->key = cache->pending_key;
+    e->program = cache->pending; // handed over, the next miss copies into a fresh one
+    memset(&cache->pending, 0, sizeof(BytecodeProgram));
+    e->result_code = result_code;
+    e->step_count = step_count;
+    e->edges = edges;
+    e->vm_count = pack_edges(vm_map, edges);
+    e->asm_count = pack_edges(asm_map, edges + e->vm_count);
+}
+
+static void unpack_edges(const uint32_t* edges, uint32_t count, EdgeMap* m) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t edge = edges[i] >> 8;
+        m->hits[edge] = (uint8_t)(edges[i] & 0xFF);
+        m->touched[m->touched_count++] = edge;
+    }
+}
+
+void exec_cache_replay(const ExecCacheEntry* entry, EdgeMap* vm_map, EdgeMap* asm_map) {
+    unpack_edges(entry->edges, entry->vm_count, vm_map);
+    unpack_edges(entry->edges + entry->vm_count, entry->asm_count, asm_map);
+}
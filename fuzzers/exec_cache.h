@@ -0,0 +1,46 @@
+#ifndef EXEC_CACHE_H
+#define EXEC_CACHE_H
+
+#include<stdbool.h>
+#include<stdint.h>
+#include"../header.h"
+#include"../coverage.h"
+
+//programs take no input, so a run is fully determined by its assembled program. mutants that only change
+//formatting (whitespace, comments, empty lines) assemble to the same program and reuse the stored run instead of forking
+
+#define EXEC_CACHE_SLOTS 4096 //direct mapped, a new key replaces whatever sat in its slot
+
+typedef struct ExecCacheEntry{
+    uint64_t key; //0 for an empty slot
+    BytecodeProgram program; //a hit has to match it exactly, the key only picks the slot
+    Errors result_code;
+    uint32_t step_count;
+    uint32_t vm_count;
+    uint32_t asm_count;
+    uint32_t* edges; //vm_count VM edges then asm_count asm edges, each edge << 8 | raw hit count
+} ExecCacheEntry;
+
+typedef struct ExecCache{
+    ExecCacheEntry* slots;
+    BytecodeProgram pending; //copy of the latest missed program, exec_cache_store files the run under it
+    uint64_t pending_key;
+    uint64_t hits;
+    uint64_t misses;
+} ExecCache;
+
+bool exec_cache_init(ExecCache* cache);
+void exec_cache_free(ExecCache* cache);
+
+//NULL on a miss, which also keeps a copy of bc for the next exec_cache_store
+const ExecCacheEntry* exec_cache_lookup(ExecCache* cache, const BytecodeProgram* bc);
+
+//stores the run of the latest missed program. maps still hold the raw counts of the run, before classification.
+//overflowed maps have no complete edge list and aren't stored
+void exec_cache_store(ExecCache* cache, Errors result_code, uint32_t step_count,
+                      const EdgeMap* vm_map, const EdgeMap* asm_map);
+
+//refills freshly reset maps as if the run had just happened
+void exec_cache_replay(const ExecCacheEntry* entry, EdgeMap* vm_map, EdgeMap* asm_map);
+
+#endif
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "fork_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+static bool read_full(int fd, void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*)data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char*)data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//waits for fd to become readable until deadline, signals don't restart the full timeout. false on timeout
+static bool poll_until(int fd, long long deadline) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    for (;;) {
+        long long left = deadline - now_ms();
+        if (left < 0) left = 0;
+        int ready = poll(&pfd, 1, (int)left);
+        if (ready > 0) return true;
+        if (ready == 0) return false;
+        if (errno != EINTR) return true; //let the following read/waitpid report it
+    }
+}
+
+//server side, never returns. the parent closing the control pipe is the shutdown signal.
+//a child that stopped itself through fork_server_yield is resumed instead of forking a new one
+static void fork_server_loop(int ctl_fd, int st_fd, ForkServerTarget target) {
+    uint32_t request;
+    pid_t child = -1;
+
+    while (read_full(ctl_fd, &request, sizeof(request))) {
+        //a timeout kill can land right after the child stopped, reap it here rather than blame the next input
+        int stale;
+        if (child > 0 && waitpid(child, &stale, WNOHANG) == child) child = -1;
+
+        if (child > 0) {
+            kill(child, SIGCONT);
+        } else {
+            child = fork();
+            if (child < 0) _exit(1);
+
+            if (child == 0) {
+                close(ctl_fd);
+                close(st_fd);
+                target();
+                exit(0);
+            }
+        }
+
+        int32_t pid_msg = (int32_t)child;
+        if (!write_full(st_fd, &pid_msg, sizeof(pid_msg))) _exit(1);
+
+        int status;
+        while (waitpid(child, &status, WUNTRACED) < 0) {
+            if (errno != EINTR) _exit(1);
+        }
+        if (!WIFSTOPPED(status)) child = -1;
+
+        int32_t status_msg = (int32_t)status;
+        if (!write_full(st_fd, &status_msg, sizeof(status_msg))) _exit(1);
+    }
+    if (child > 0) kill(child, SIGKILL);
+    _exit(0);
+}
+
+void fork_server_yield(void) {
+    raise(SIGSTOP);
+}
+
+bool fork_server_start(ForkServer* fs, ForkServerTarget target) {
+    int ctl[2], st[2];
+
+    fs->pid = -1;
+    fs->ctl_fd = -1;
+    fs->st_fd = -1;
+
+    //a dead server shows up as EPIPE on the control pipe, not as a signal in the fuzzer
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pipe(ctl) < 0) {
+        perror("pipe ctl");
+        return false;
+    }
+    if (pipe(st) < 0) {
+        perror("pipe st");
+        close(ctl[0]);
+        close(ctl[1]);
+        return false;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork server");
+        close(ctl[0]); close(ctl[1]);
+        close(st[0]); close(st[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(ctl[1]);
+        close(st[0]);
+        fork_server_loop(ctl[0], st[1], target);
+    }
+
+    close(ctl[0]);
+    close(st[1]);
+    fs->pid = pid;
+    fs->ctl_fd = ctl[1];
+    fs->st_fd = st[0];
+    return true;
+}
+
+bool fork_server_run(ForkServer* fs, int timeout_ms, int* status, bool* timed_out) {
+    uint32_t request = 0;
+    int32_t child, status_msg;
+
+    *timed_out = false;
+    if (fs->pid <= 0) return false;
+
+    if (!write_full(fs->ctl_fd, &request, sizeof(request))) return false;
+    if (!read_full(fs->st_fd, &child, sizeof(child))) return false;
+
+    if (!poll_until(fs->st_fd, now_ms() + timeout_ms)) {
+        //the grandchild belongs to the server, but the kill still comes from here and the server reaps it
+        kill((pid_t)child, SIGKILL);
+        *timed_out = true;
+    }
+
+    if (!read_full(fs->st_fd, &status_msg, sizeof(status_msg))) return false;
+    *status = (int)status_msg;
+    return true;
+}
+
+bool wait_child(pid_t pid, int timeout_ms, int* status, bool* timed_out) {
+    long long deadline = now_ms() + timeout_ms;
+    *timed_out = false;
+
+#ifdef SYS_pidfd_open
+    //a pidfd turns readable when the child exits, no SIGCHLD handler or sleep needed
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+        if (!poll_until(pidfd, deadline)) {
+            kill(pid, SIGKILL);
+            *timed_out = true;
+        }
+        close(pidfd);
+        while (waitpid(pid, status, 0) < 0) {
+            if (errno != EINTR) return false;
+        }
+        return true;
+    }
+#endif
+
+    //kernels before 5.3: back off from 50us to 5ms so short runs are still picked up quickly
+    long sleep_ns = 50 * 1000;
+    for (;;) {
+        pid_t r = waitpid(pid, status, WNOHANG);
+        if (r == pid) return true;
+        if (r < 0 && errno != EINTR) return false;
+        if (now_ms() >= deadline) {
+            kill(pid, SIGKILL);
+            waitpid(pid, status, 0);
+            *timed_out = true;
+            return true;
+        }
+        struct timespec ts = {0, sleep_ns};
+        nanosleep(&ts, NULL);
+        if (sleep_ns < 5 * 1000 * 1000) sleep_ns *= 2;
+    }
+}
+
+void fork_server_stop(ForkServer* fs) {
+    if (fs->ctl_fd >= 0) close(fs->ctl_fd);
+    if (fs->st_fd >= 0) close(fs->st_fd);
+    if (fs->pid > 0) {
+        kill(fs->pid, SIGKILL);
+        waitpid(fs->pid, NULL, 0);
+    }
+    fs->pid = -1;
+    fs->ctl_fd = -1;
+    fs->st_fd = -1;
+}
@@ -0,0 +1,35 @@
+#ifndef FORK_SERVER_H
+#define FORK_SERVER_H
+
+#include<stdbool.h>
+#include<sys/types.h>
+
+//AFL-style fork server: a child forked once, before the fuzzer builds its maps and corpus, blocks on a
+//control pipe and forks one grandchild per test case. pid and waitpid status come back on a status pipe
+
+//runs in the grandchild and has to end in exit(). a persistent target loops over several test cases and
+//calls fork_server_yield after each one but the last, the parent then sees a WIFSTOPPED status
+typedef void (*ForkServerTarget)(void);
+
+typedef struct ForkServer{
+    pid_t pid;
+    int ctl_fd; //parent -> server, 4 bytes per test case
+    int st_fd;  //server -> parent, grandchild pid then its waitpid status
+} ForkServer;
+
+bool fork_server_start(ForkServer* fs, ForkServerTarget target);
+
+//runs one test case and fills the grandchild's waitpid status. past timeout_ms the grandchild is killed
+//and *timed_out set. false means the server itself is gone
+bool fork_server_run(ForkServer* fs, int timeout_ms, int* status, bool* timed_out);
+
+void fork_server_stop(ForkServer* fs);
+
+//blocks until pid exits or timeout_ms passes, then kills it, sets *timed_out and reaps it.
+//used for plain fork-per-test runs, false only if waitpid itself fails
+bool wait_child(pid_t pid, int timeout_ms, int* status, bool* timed_out);
+
+//persistent targets: hands the finished test case back and sleeps until the next request
+void fork_server_yield(void);
+
+#endif
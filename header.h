@@ -5,24 +5,51 @@
 #include<stdbool.h>
 #include<stddef.h>
 #include<stdint.h>
+#include"error.h"
 
 #define MAXSTEPS 100000
+#define GUARD_PAGE_STACKS 0 //1: stacks get mmap'd with a PROT_NONE page below them and underflows fault into it instead of being checked, needs vm_run_guarded + vm_free
+#define LOOP_CHECK 1 //programs take no input, so a repeated VM state at a backward jump can never halt. 0 runs them out to MAXSTEPS
+#define LOOP_HASH_WINDOW 8 //top stack and callstack slots a back edge hashes, a hash match is confirmed against the saved state
 #define CALLSIZE 124
 #define MAXLABELS 124
 #define STACKSIZE 256
 #define MEMSIZE 1024
 typedef enum {IMM, REG, LABEL, NONE} OperandType;
-typedef enum {PSH, ADD, SUB, MUL, DIV, POP, SET, LOAD, HLT, LBL, JMP, JE, JNE, JG, JGE, JL, JLE, CMP, CALL, RET, INC, DEC, OPCODE} Operations;
+typedef enum {PSH, ADD, SUB, MUL, DIV, POP, SET, LOAD, HLT, LBL, JMP, JE, JNE, JG, JGE, JL, JLE, CMP, CALL, RET, INC, DEC, OPCODE,
+  //superinstructions, never produced by the parser, only by fuse_program
+  CMP_JE = OPCODE, CMP_JNE, CMP_JG, CMP_JGE, CMP_JL, CMP_JLE,
+  PSH_PSH_ADD, PSH_PSH_SUB, PSH_PSH_MUL, PSH_PSH_DIV,
+  LOAD_LOAD_ADD, LOAD_LOAD_SUB, LOAD_LOAD_MUL, LOAD_LOAD_DIV,
+  //same without the stack/callstack bounds check, only produced by verify_program where it can never fire
+  PSH_NC, ADD_NC, SUB_NC, MUL_NC, DIV_NC, POP_NC, LOAD_NC, CALL_NC, RET_NC,
+  NUM_OPCODES} Operations;
 typedef struct VM VM;
 typedef struct Instr Instr;
 typedef struct Label Label;
+typedef struct RegProgram RegProgram;
+typedef struct JitProgram JitProgram;
+typedef struct TraceCache TraceCache;
+typedef struct VMCoverage VMCoverage;
 typedef void (*InstrFunc)(VM*, const Instr*);
+typedef void (*VMTraceFunc)(VM*, const Instr*); //called before each instruction executes, NULL for none
+typedef void (*VMEngine)(VM*, VMTraceFunc); //any of the vm_run* loops
 typedef struct Flags{
   bool of; // substraction overflow,
   bool sf; // sign + - of substract result
   bool zf; // is the result zero
 }Flags;
 
+//shared by every engine so CMP sets flags the same way everywhere. the subtraction wraps explicitly: as signed
+//overflow the compiler may assume it never happens and fold of to 0
+static inline void flags_from_cmp(Flags* flags, int a, int b){
+  int assess = (int)((unsigned)a - (unsigned)b);
+  flags->zf = (assess == 0);
+  flags->sf = (assess < 0);
+  flags->of = ((a < 0 && b > 0 && assess > 0) ||
+               (a > 0 && b < 0 && assess < 0));
+}
+
 typedef struct Operand{
    OperandType type;
     union{
@@ -30,6 +57,7 @@ typedef struct Operand{
       int reg;
       const char* label;
     } value;
+    int target; //instruction index a LABEL operand resolves to, filled by link_labels
 }Operand;
 
 typedef struct Instr{
@@ -38,20 +66,64 @@ typedef struct Instr{
   Operand operand1;
   Operand operand2;
   InstrFunc execute;
+  int steps; //what running it adds to stepcount, 1 unless optimize_program merged other instructions into it
 
 } Instr;
 
 typedef enum {A, B, C, D, E, NUMOFREGS} Regs;
 
+//packed encoding, one word per instruction, emitted by the assembler next to the Instr array
+// bits  0-7  opcode
+// bits  8-9  operand1 type, bits 10-11 operand2 type
+// bits 16-23 register index (or const pool slot for an IMM first operand of a two-operand instruction)
+// bits 24-31 step count (Instr.steps)
+// bits 32-63 immediate, register of the second operand, or resolved jump target
+typedef uint64_t Bytecode;
+
+#define BC_OP(w)    ((Operations)((w) & 0xFF))
+#define BC_TYPE1(w) ((OperandType)(((w) >> 8) & 0x3))
+#define BC_TYPE2(w) ((OperandType)(((w) >> 10) & 0x3))
+#define BC_REG(w)   ((int)(((w) >> 16) & 0xFF))
+#define BC_STEPS(w) ((int)(((w) >> 24) & 0xFF))
+#define BC_IMM(w)   ((int)(int32_t)((w) >> 32))
+#define BC_MAKE(op, t1, t2, reg, imm) \
+  ((Bytecode)((op) & 0xFF) | ((Bytecode)((t1) & 0x3) << 8) | ((Bytecode)((t2) & 0x3) << 10) | \
+   ((Bytecode)((reg) & 0xFF) << 16) | ((Bytecode)(uint32_t)(imm) << 32))
+
+typedef struct BytecodeProgram{
+  Bytecode *code;
+  int *consts; //IMM first operands that don't fit in the word (cmp 5 A)
+  int size;
+  int const_count;
+} BytecodeProgram;
+
 typedef struct Label{
   char name[64];
   int address;
 } Label;
 
+//what vm_back_edge saves to compare later states against, only the live part of the stacks is written
+typedef struct LoopState{
+  int ip;
+  int sp;
+  int call_sp;
+  Flags flags;
+  int registers[NUMOFREGS];
+  int stack[STACKSIZE];
+  int callstack[CALLSIZE];
+} LoopState;
+
 typedef struct VM {
   int call_sp;
+#if GUARD_PAGE_STACKS
+  int *callstack;
+  int *stack;
+  void *guard_map; //both stacks and their guard pages, see vm_init
+  size_t guard_map_size;
+#else
   int callstack[CALLSIZE];
   int stack[STACKSIZE];
+#endif
   int sp;
   int ip;
   int lb;
@@ -60,10 +132,45 @@ typedef struct VM {
   bool running;
   int registers[NUMOFREGS];
   const Instr *program;
+  int program_size;
+  const BytecodeProgram *bytecode;
+  const RegProgram *regprog;
+  const JitProgram *jit;
+  TraceCache *traces; //written while running, loop counters and compiled traces
+  VMCoverage *cov; //where the instrumented vm_run variants record, NULL otherwise
   Label labels[MAXLABELS];
+  //first runtime fault, ERR_OK while the program is fine. handlers set it through vm_fault and return
+  Errors error;
+  int error_ip;
+  const char* error_instr;
+  const char* error_detail;
+  uint32_t call_ctx; //XOR of one key per active CALL frame, 0 at top level. coverage mixes it in for call-path sensitivity
+  //Brent's cycle check over states taken at backward jumps, see vm_back_edge
+  uint64_t loop_hash;
+  uint32_t loop_power;
+  uint32_t loop_lam;
+  LoopState loop_state;
 } VM;
 
 
+//engine
+void vm_init(VM* vm, const Instr* program, int program_size);
+void vm_free(VM* vm); //releases the guarded stacks, no-op without GUARD_PAGE_STACKS
+//runs engine with underflows turned into faults by the guard pages, plain engine(vm, trace) without GUARD_PAGE_STACKS
+void vm_run_guarded(VM* vm, VMEngine engine, VMTraceFunc trace);
+void vm_run(VM* vm, VMTraceFunc trace); //threaded dispatch (computed goto on GCC/clang)
+//vm_run compiled with its instrumentation built in instead of a per-step trace call, the instrumented ones still call trace if set
+void vm_run_plain(VM* vm, VMTraceFunc trace); //nothing recorded and trace ignored, for replay and benchmarks
+void vm_run_edges(VM* vm, VMTraceFunc trace); //edges into vm->cov, presence only
+void vm_run_hits(VM* vm, VMTraceFunc trace); //edges with hit counts
+void vm_run_cmplog(VM* vm, VMTraceFunc trace); //hit counts plus every CMP's operands into vm->cov->cmp_log
+void vm_run_indirect(VM* vm, VMTraceFunc trace); //instr->execute per step, reference path
+void vm_step(VM* vm, VMTraceFunc trace); //one fetch/execute/count, what vm_run_indirect loops on
+void vm_run_bytecode(VM* vm, VMTraceFunc trace); //threaded over vm->bytecode, trace still receives the Instr
+void vm_fault(VM* vm, Errors err, const char* instr, const char* detail); //records the error and stops the VM
+void vm_back_edge(VM* vm); //loop check at a taken backward jump, ip already at the target
+void vm_exit_on_error(const VM* vm); //report_vm_error + exit if the run faulted, no-op otherwise
+
 //helper function
 void label_parse(VM* vm, int program_size);
 int assess_operand(VM*vm, Operand op);
@@ -90,6 +197,31 @@ void instr_call(VM*vm, const Instr* instrc);
 void instr_ret(VM*vm, const Instr* instrc);
 void instr_inc(VM*vm, const Instr* instrc);
 void instr_dec(VM*vm, const Instr* instrc);
+//fused, instrc points at the first component and the rest follow it in the program
+void instr_cmp_je(VM*vm, const Instr* instrc);
+void instr_cmp_jne(VM*vm, const Instr* instrc);
+void instr_cmp_jg(VM*vm, const Instr* instrc);
+void instr_cmp_jge(VM*vm, const Instr* instrc);
+void instr_cmp_jl(VM*vm, const Instr* instrc);
+void instr_cmp_jle(VM*vm, const Instr* instrc);
+void instr_psh_psh_add(VM*vm, const Instr* instrc);
+void instr_psh_psh_sub(VM*vm, const Instr* instrc);
+void instr_psh_psh_mul(VM*vm, const Instr* instrc);
+void instr_psh_psh_div(VM*vm, const Instr* instrc);
+void instr_load_load_add(VM*vm, const Instr* instrc);
+void instr_load_load_sub(VM*vm, const Instr* instrc);
+void instr_load_load_mul(VM*vm, const Instr* instrc);
+void instr_load_load_div(VM*vm, const Instr* instrc);
+//unchecked, anything besides the bounds check (DIV by zero, loop check) still faults
+void instr_psh_nc(VM*vm, const Instr* instrc);
+void instr_add_nc(VM*vm, const Instr* instrc);
+void instr_sub_nc(VM*vm, const Instr* instrc);
+void instr_mul_nc(VM*vm, const Instr* instrc);
+void instr_div_nc(VM*vm, const Instr* instrc);
+void instr_pop_nc(VM*vm, const Instr* instrc);
+void instr_load_nc(VM*vm, const Instr* instrc);
+void instr_call_nc(VM*vm, const Instr* instrc);
+void instr_ret_nc(VM*vm, const Instr* instrc);
 
 
 
@@ -112,12 +244,58 @@ typedef struct Instr_template{
 extern Instr_template lookup[];
 extern const char* operation_names[];
 
+#define MAX_FUSION_WIDTH 3
+
+typedef struct FusionRule{
+  Operations fused;
+  int width;
+  Operations pattern[MAX_FUSION_WIDTH];
+  InstrFunc execute;
+} FusionRule;
+
+extern FusionRule fusion_table[];
+extern const int fusion_table_size;
+
+typedef struct UncheckedRule{
+  Operations checked;
+  Operations unchecked;
+  InstrFunc execute;
+} UncheckedRule;
+
+extern UncheckedRule unchecked_table[];
+extern const int unchecked_table_size;
+
+
+#define MAX_TOKEN_LENGTH 64
 
-void define_program(Instr **out_program, int *out_size, Label **out_labels, int *out_label_count);
+//outcome of one assembly. on success the caller owns program and labels (free_program + free),
+//on failure everything is already released and error/line/token say what went wrong
+typedef struct AsmResult{
+  Instr *program;
+  int program_size;
+  Label *labels;
+  int label_count;
+  Errors error; //ERR_OK on success
+  int line; //1-based source line of the error, 0 when it isn't tied to one
+  char token[MAX_TOKEN_LENGTH];
+  bool has_token;
+  const char* detail;
+} AsmResult;
+
+bool assemble_buffer(const char* src, size_t len, AsmResult* out); //in memory, never exits
+void define_program(Instr **out_program, int *out_size, Label **out_labels, int *out_label_count); //reads fuzz_input.txt, report_asm_error on failure
 void free_program(Instr* program, int program_size);
 
 //label stuff, just for reference
-Label* parse_labels(Instr* program, int program_size, int*out_lb_count, int max_labels);
+Label* parse_labels(Instr* program, int program_size, int*out_lb_count, int max_labels, AsmResult* res);
+bool link_labels(Instr* program, int program_size, const Label* labels, int label_count, AsmResult* res);
+
+//superinstructions, rewrites matches of fusion_table in place and returns how many were fused
+int fuse_program(Instr* program, int program_size);
+
+//packed encoding. ERR_OPERAND_OUT_OF_RANGE when the program needs more than 256 consts or an Instr.steps over 255
+Errors emit_bytecode(const Instr* program, int program_size, BytecodeProgram* out);
+void free_bytecode(BytecodeProgram* bc);
 
 
 
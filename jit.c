@@ -0,0 +1,1170 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdbool.h>
+#include<stdint.h>
+#include<stddef.h>
+#include<string.h>
+#include"header.h"
+#include"error.h"
+#include"cfg.h"
+#include"jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include<sys/mman.h>
+#include<unistd.h>
+
+//ENCODING
+
+enum {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15};
+
+//A-E, callee-saved so they survive the calls out to vm_back_edge
+static const int vm_reg[NUMOFREGS] = {RBX, R12, R13, R14, R15};
+#define R_VM    RBP
+#define R_STEPS R8  //vm->stepcount, already including the rest of the current block
+#define R_STACK R9  //&vm->stack[0]
+#define R_SP    R10 //vm->sp
+
+enum {CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_S = 0x8, CC_L = 0xC, CC_GE = 0xD, CC_G = 0xF};
+//81 /n group
+enum {ALU_ADD = 0, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7};
+
+#define OFF(field) ((int)offsetof(VM, field))
+#define OFF_REG(r) (OFF(registers) + 4 * (r))
+#define OFF_FLAG(f) (OFF(flags) + (int)offsetof(Flags, f))
+
+//labels are per ip, one kind after the other, plus the shared ones at the end
+enum {L_BLOCK, L_BODY, L_MID, L_AT, L_BEFORE, L_BACK, L_RESUME, L_KINDS};
+#define LABEL(j, kind, ip) ((kind) * ((j)->n + 1) + (ip))
+#define L_EXIT(j)     (L_KINDS * ((j)->n + 1))
+#define L_END(j)      (L_EXIT(j) + 1) //ip == program_size
+#define L_EXIT_EAX(j) (L_EXIT(j) + 2) //RET to an ip outside the program, eax holds it
+
+//code is generated twice with the same layout: the first pass sizes the buffer and binds every label, the
+//second writes into it, so every jump is rel32 and never depends on its distance
+typedef struct Jit{
+  uint8_t *buf; //NULL while sizing
+  size_t len;
+  int *label; //code offset, from the first pass while the second one runs
+  bool *used; //referenced, stubs nobody jumps to are left out
+  int nlabels;
+  const Instr *program;
+  int n;
+  CFG cfg;
+  int *rest; //Instr.steps from ip to the end of its block, terminator included
+  int *block_off; //code offset of each block, for the perf map
+  void **table;
+} Jit;
+
+static void byte(Jit* j, int b){
+  if(j->buf) j->buf[j->len] = (uint8_t)b;
+  j->len++;
+}
+
+static void imm32(Jit* j, int32_t v){
+  for(int k=0; k<4; k++) byte(j, (int)(((uint32_t)v >> (8 * k)) & 0xFF));
+}
+
+static void imm64(Jit* j, uint64_t v){
+  for(int k=0; k<8; k++) byte(j, (int)((v >> (8 * k)) & 0xFF));
+}
+
+static void rex(Jit* j, int w, int reg, int index, int base){
+  int v = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+  if(v != 0x40) byte(j, v);
+}
+
+//REX then the opcode, opc > 0xFF is a two byte 0F xx
+static void op(Jit* j, int w, int reg, int index, int base, int opc){
+  rex(j, w, reg, index, base);
+  if(opc > 0xFF) byte(j, opc >> 8);
+  byte(j, opc & 0xFF);
+}
+
+static void modrm(Jit* j, int mod, int reg, int rm){
+  byte(j, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void sib(Jit* j, int scale, int index, int base){
+  byte(j, (scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+//[rbp + disp32]
+static void at_vm(Jit* j, int reg, int disp){
+  modrm(j, 2, reg, R_VM);
+  imm32(j, disp);
+}
+
+//[r9 + r10*4 + disp], disp 0 is the top of the stack
+static void at_slot(Jit* j, int reg, int disp){
+  bool small = disp >= -128 && disp <= 127;
+  modrm(j, small ? 1 : 2, reg, 4);
+  sib(j, 2, R_SP, R_STACK);
+  if(small) byte(j, disp & 0xFF);
+  else imm32(j, disp);
+}
+
+//[base + index*4]
+static void at_index(Jit* j, int reg, int index, int base){
+  modrm(j, 0, reg, 4);
+  sib(j, 2, index, base);
+}
+
+static void bind(Jit* j, int label){
+  j->label[label] = (int)j->len;
+}
+
+static void rel32(Jit* j, int label){
+  j->used[label] = true;
+  imm32(j, j->label[label] - (int)(j->len + 4));
+}
+
+static void jmp(Jit* j, int label){
+  byte(j, 0xE9);
+  rel32(j, label);
+}
+
+static void jcc(Jit* j, int cc, int label){
+  byte(j, 0x0F);
+  byte(j, 0x80 | cc);
+  rel32(j, label);
+}
+
+static void load_vm(Jit* j, int r, int disp){ op(j, 0, r, 0, R_VM, 0x8B); at_vm(j, r, disp); }
+static void store_vm(Jit* j, int disp, int r){ op(j, 0, r, 0, R_VM, 0x89); at_vm(j, r, disp); }
+static void store_vm_imm(Jit* j, int disp, int v){ op(j, 0, 0, 0, R_VM, 0xC7); at_vm(j, 0, disp); imm32(j, v); }
+static void store_vm_byte(Jit* j, int disp, int v){ op(j, 0, 0, 0, R_VM, 0xC6); at_vm(j, 0, disp); byte(j, v); }
+static void cmp_vm_imm(Jit* j, int disp, int v){ op(j, 0, 0, 0, R_VM, 0x81); at_vm(j, ALU_CMP, disp); imm32(j, v); }
+//r8 op= byte [vm+disp], opc 8A mov, 32 xor, 0A or
+static void byte_vm(Jit* j, int opc, int r, int disp){ op(j, 0, r, 0, R_VM, opc); at_vm(j, r, disp); }
+static void setcc_vm(Jit* j, int cc, int disp){ op(j, 0, 0, 0, R_VM, 0x0F90 | cc); at_vm(j, 0, disp); }
+static void setcc_r(Jit* j, int cc, int r){ op(j, 0, 0, 0, r, 0x0F90 | cc); modrm(j, 3, 0, r); }
+
+static void mov_ri(Jit* j, int r, int v){ rex(j, 0, 0, 0, r); byte(j, 0xB8 + (r & 7)); imm32(j, v); }
+static void mov_ri64(Jit* j, int r, uint64_t v){ rex(j, 1, 0, 0, r); byte(j, 0xB8 + (r & 7)); imm64(j, v); }
+//dst op= src, opc 89 mov, 01 add, 29 sub, 31 xor, 21 and, 85 test
+static void alu_rr(Jit* j, int opc, int dst, int src){ op(j, 0, src, 0, dst, opc); modrm(j, 3, src, dst); }
+static void alu_ri(Jit* j, int ext, int r, int v){ op(j, 0, 0, 0, r, 0x81); modrm(j, 3, ext, r); imm32(j, v); }
+static void inc_r(Jit* j, int r){ op(j, 0, 0, 0, r, 0xFF); modrm(j, 3, 0, r); }
+static void dec_r(Jit* j, int r){ op(j, 0, 0, 0, r, 0xFF); modrm(j, 3, 1, r); }
+static void shl_ri(Jit* j, int r, int n){ op(j, 0, 0, 0, r, 0xC1); modrm(j, 3, 4, r); byte(j, n); }
+static void imul_rri(Jit* j, int dst, int src, int v){ op(j, 0, dst, 0, src, 0x69); modrm(j, 3, dst, src); imm32(j, v); }
+
+//r op [slot + disp], opc 8B load, 89 store, 01/29 add/sub into the slot, 03/2B add/sub from it, 0FAF imul
+static void slot_op(Jit* j, int opc, int r, int disp){ op(j, 0, r, R_SP, R_STACK, opc); at_slot(j, r, disp); }
+static void slot_store_imm(Jit* j, int disp, int v){ op(j, 0, 0, R_SP, R_STACK, 0xC7); at_slot(j, 0, disp); imm32(j, v); }
+
+//the stacks are arrays inside the VM, or pointers to the guarded mapping
+static void stack_base(Jit* j, int r, int disp){
+  op(j, 1, r, 0, R_VM, GUARD_PAGE_STACKS ? 0x8B : 0x8D);
+  at_vm(j, r, disp);
+}
+
+static void push_r(Jit* j, int r){ rex(j, 0, 0, 0, r); byte(j, 0x50 + (r & 7)); }
+static void pop_r(Jit* j, int r){ rex(j, 0, 0, 0, r); byte(j, 0x58 + (r & 7)); }
+
+//TEMPLATES
+
+//what the compiled code keeps in machine registers goes back into the VM
+static void save_state(Jit* j){
+  for(int r=0; r<NUMOFREGS; r++) store_vm(j, OFF_REG(r), vm_reg[r]);
+  store_vm(j, OFF(sp), R_SP);
+  store_vm(j, OFF(stepcount), R_STEPS);
+}
+
+//r8-r10 are caller-saved, reloaded after every call out. sp is sign-extended, traces address slots below it
+static void load_state(Jit* j){
+  op(j, 1, R_SP, 0, R_VM, 0x63); //movsxd
+  at_vm(j, R_SP, OFF(sp));
+  load_vm(j, R_STEPS, OFF(stepcount));
+  stack_base(j, R_STACK, OFF(stack));
+}
+
+//jmp [table + rax*8], rax zero-extended and already checked against program_size
+static void dispatch(Jit* j){
+  mov_ri64(j, RCX, (uint64_t)(uintptr_t)j->table);
+  byte(j, 0xFF);
+  modrm(j, 0, 4, 4);
+  sib(j, 3, RAX, RCX);
+}
+
+//entry point for a jump landing on ip: the block guard at leaders, the mid-block guard otherwise
+static int entry_label(Jit* j, int ip){
+  if(ip == j->n) return L_END(j);
+  return cfg_block_at(&j->cfg, ip) >= 0 ? LABEL(j, L_BLOCK, ip) : LABEL(j, L_MID, ip);
+}
+
+//MAXSTEPS for everything from ip to the end of its block at once, the interpreter takes over when it could trip
+static void guard(Jit* j, int ip){
+  alu_ri(j, ALU_CMP, R_STEPS, MAXSTEPS - j->rest[ip]);
+  jcc(j, CC_GE, LABEL(j, L_BEFORE, ip));
+  alu_ri(j, ALU_ADD, R_STEPS, j->rest[ip]);
+}
+
+//leave right before ip, vm_run_jit steps it through its handler
+static void fail(Jit* j, int ip){ jmp(j, LABEL(j, L_AT, ip)); }
+static void fail_if(Jit* j, int cc, int ip){ jcc(j, cc, LABEL(j, L_AT, ip)); }
+
+//vm_back_edge with ip at the target (eax when target < 0) and stepcount taken back by the unsettled steps
+//(the jump's own included), same as inside instr_jmp/instr_ret. leaves when the loop check faults
+static void back_edge(Jit* j, int unsettled, int target){
+  if(target >= 0) store_vm_imm(j, OFF(ip), target);
+  else store_vm(j, OFF(ip), RAX);
+  alu_ri(j, ALU_SUB, R_STEPS, unsettled);
+  save_state(j);
+  op(j, 1, R_VM, 0, RDI, 0x89);
+  modrm(j, 3, R_VM, RDI);
+  mov_ri64(j, RAX, (uint64_t)(uintptr_t)vm_back_edge);
+  byte(j, 0xFF);
+  modrm(j, 3, 2, RAX);
+  load_state(j);
+  cmp_vm_imm(j, OFF(error), ERR_OK);
+  jcc(j, CC_NE, L_EXIT(j));
+  alu_ri(j, ALU_ADD, R_STEPS, unsettled);
+}
+
+static bool is_unchecked(Operations id){
+  for(int k=0; k<unchecked_table_size; k++){
+    if(unchecked_table[k].unchecked == id) return true;
+  }
+  return false;
+}
+
+static bool valid_reg(int r){
+  return r >= 0 && r < NUMOFREGS;
+}
+
+//CMP operand into r, false when assess_operand would fault on it
+static bool cmp_operand(Jit* j, int r, Operand o){
+  if(o.type == IMM){
+    mov_ri(j, r, o.value.imm);
+    return true;
+  }
+  if(o.type == REG && valid_reg(o.value.reg)){
+    alu_rr(j, 0x89, r, vm_reg[o.value.reg]);
+    return true;
+  }
+  return false;
+}
+
+static void jump_to(Jit* j, int ip, int target){
+  if(LOOP_CHECK && target <= ip) back_edge(j, j->rest[ip], target);
+  jmp(j, entry_label(j, target));
+}
+
+//CMP's flags into the VM, false when assess_operand would fault on an operand
+static bool cmp_flags(Jit* j, const Instr* in){
+  if(!cmp_operand(j, RAX, in->operand1) || !cmp_operand(j, RCX, in->operand2)) return false;
+  //flags_from_cmp: x86 OF matches its of except when a == 0
+  alu_rr(j, 0x89, RDX, RAX);
+  alu_rr(j, 0x29, RDX, RCX);
+  setcc_vm(j, CC_E, OFF_FLAG(zf));
+  setcc_vm(j, CC_S, OFF_FLAG(sf));
+  setcc_r(j, CC_O, RDX);
+  alu_rr(j, 0x85, RAX, RAX);
+  setcc_r(j, CC_NE, RAX);
+  op(j, 0, RAX, 0, RDX, 0x20); //and dl, al
+  modrm(j, 3, RAX, RDX);
+  byte_vm(j, 0x88, RDX, OFF_FLAG(of));
+  return true;
+}
+
+//tests the VM flags for a Jcc, returns the condition code under which it is taken
+static int flags_taken(Jit* j, Operations id){
+  if(id == JE || id == JNE){
+    op(j, 0, 0, 0, R_VM, 0x80);
+    at_vm(j, ALU_CMP, OFF_FLAG(zf));
+    byte(j, 0);
+    return (id == JE) ? CC_NE : CC_E;
+  }
+  //al = (sf != of), the signed less-than
+  byte_vm(j, 0x8A, RAX, OFF_FLAG(sf));
+  byte_vm(j, 0x32, RAX, OFF_FLAG(of));
+  if(id == JGE){
+    byte(j, 0x34);
+    byte(j, 1); //xor al, 1
+  }
+  if(id == JGE || id == JLE) byte_vm(j, 0x0A, RAX, OFF_FLAG(zf));
+  else{
+    byte(j, 0x84);
+    modrm(j, 3, RAX, RAX); //test al, al
+  }
+  return (id == JG) ? CC_E : CC_NE;
+}
+
+//call_ctx ^= call_ctx_key(ret, depth), ret in eax/edx clobbering r, depth in d
+static void call_ctx_mix(Jit* j, int r, int ret, int depth){
+  alu_rr(j, 0x89, r, depth);
+  shl_ri(j, r, 16);
+  if(ret >= 0) alu_ri(j, ALU_XOR, r, ret);
+  else alu_rr(j, 0x31, r, RAX);
+  imul_rri(j, r, r, (int)0x9E3779B1u);
+  op(j, 0, r, 0, R_VM, 0x31);
+  at_vm(j, r, OFF(call_ctx));
+}
+
+static void emit_instr(Jit* j, int ip){
+  const Instr *in = &j->program[ip];
+  Operations id = cfg_source_id(in);
+  bool checked = !is_unchecked(in->ID);
+  int target = in->operand1.target;
+  //an unresolved or out of range target is the interpreter's to report
+  if((id == JMP || id == CALL || (id >= JE && id <= JLE)) && (target < 0 || target > j->n)){
+    fail(j, ip);
+    return;
+  }
+
+  switch(id){
+    case PSH:
+    case LOAD:
+      if(id == LOAD && !valid_reg(in->operand1.value.reg)){ fail(j, ip); break; }
+      if(checked){
+        alu_ri(j, ALU_CMP, R_SP, STACKSIZE - 1);
+        fail_if(j, CC_GE, ip);
+      }
+      inc_r(j, R_SP);
+      if(id == PSH) slot_store_imm(j, 0, in->operand1.value.imm);
+      else slot_op(j, 0x89, vm_reg[in->operand1.value.reg], 0);
+      break;
+    case POP:
+      if(checked){
+        alu_rr(j, 0x85, R_SP, R_SP);
+        fail_if(j, CC_S, ip);
+      }
+      dec_r(j, R_SP);
+      break;
+    case ADD: case SUB: case MUL: case DIV:
+      if(checked){
+        alu_ri(j, ALU_CMP, R_SP, 1);
+        fail_if(j, CC_L, ip);
+      }
+      if(id == DIV){
+        slot_op(j, 0x8B, RCX, 0);
+        alu_rr(j, 0x85, RCX, RCX);
+        fail_if(j, CC_E, ip);
+        slot_op(j, 0x8B, RAX, -4);
+        byte(j, 0x99); //cdq
+        op(j, 0, 0, 0, RCX, 0xF7);
+        modrm(j, 3, 7, RCX); //idiv ecx
+        dec_r(j, R_SP);
+        slot_op(j, 0x89, RAX, 0);
+        break;
+      }
+      slot_op(j, 0x8B, RAX, 0);
+      dec_r(j, R_SP);
+      if(id == ADD) slot_op(j, 0x01, RAX, 0);
+      else if(id == SUB) slot_op(j, 0x29, RAX, 0);
+      else{
+        slot_op(j, 0x0FAF, RAX, 0);
+        slot_op(j, 0x89, RAX, 0);
+      }
+      break;
+    case SET:
+    case INC:
+    case DEC: {
+      int r = in->operand1.value.reg;
+      if(!valid_reg(r)){ fail(j, ip); break; }
+      if(id == SET) mov_ri(j, vm_reg[r], in->operand2.value.imm);
+      else if(id == INC) inc_r(j, vm_reg[r]);
+      else dec_r(j, vm_reg[r]);
+      break;
+    }
+    case CMP:
+      if(!cmp_flags(j, in)) fail(j, ip);
+      break;
+    case LBL:
+      break;
+    case HLT:
+      store_vm_byte(j, OFF(running), 0);
+      store_vm_imm(j, OFF(ip), ip + 1);
+      jmp(j, L_EXIT(j));
+      break;
+    case JMP:
+      jump_to(j, ip, target);
+      break;
+    case JE: case JNE: case JG: case JGE: case JL: case JLE:
+      jcc(j, flags_taken(j, id), (LOOP_CHECK && target <= ip) ? LABEL(j, L_BACK, ip) : entry_label(j, target));
+      break;
+    case CALL:
+      if(checked){
+        cmp_vm_imm(j, OFF(call_sp), CALLSIZE - 2);
+        fail_if(j, CC_G, ip);
+      }
+      load_vm(j, RCX, OFF(call_sp));
+      inc_r(j, RCX);
+      store_vm(j, OFF(call_sp), RCX);
+      stack_base(j, RDX, OFF(callstack));
+      op(j, 0, 0, RCX, RDX, 0xC7);
+      at_index(j, 0, RCX, RDX);
+      imm32(j, ip + 1);
+      call_ctx_mix(j, RAX, ip + 1, RCX);
+      jump_to(j, ip, target);
+      break;
+    case RET:
+      load_vm(j, RCX, OFF(call_sp));
+      //checked with guard pages too, the fault has to come from the handler and not from compiled code
+      if(checked){
+        alu_rr(j, 0x85, RCX, RCX);
+        fail_if(j, CC_S, ip);
+      }
+      stack_base(j, RDX, OFF(callstack));
+      op(j, 0, RAX, RCX, RDX, 0x8B);
+      at_index(j, RAX, RCX, RDX);
+      call_ctx_mix(j, RDX, -1, RCX);
+      dec_r(j, RCX);
+      store_vm(j, OFF(call_sp), RCX);
+      if(LOOP_CHECK){
+        alu_ri(j, ALU_CMP, RAX, ip + 1);
+        jcc(j, CC_L, LABEL(j, L_BACK, ip));
+        bind(j, LABEL(j, L_RESUME, ip));
+      }
+      alu_ri(j, ALU_CMP, RAX, j->n);
+      jcc(j, CC_A, L_EXIT_EAX(j));
+      dispatch(j);
+      break;
+    default:
+      fail(j, ip);
+      break;
+  }
+}
+
+//System V: rdi = vm. six pushes and the pad keep rsp 16-aligned for the calls out
+static void emit_prologue(Jit* j){
+  push_r(j, RBP);
+  push_r(j, RBX);
+  push_r(j, R12);
+  push_r(j, R13);
+  push_r(j, R14);
+  push_r(j, R15);
+  op(j, 1, 0, 0, RSP, 0x83);
+  modrm(j, 3, 5, RSP);
+  byte(j, 8);
+  op(j, 1, RDI, 0, R_VM, 0x89);
+  modrm(j, 3, RDI, R_VM);
+  for(int r=0; r<NUMOFREGS; r++) load_vm(j, vm_reg[r], OFF_REG(r));
+  load_state(j);
+}
+
+static void emit_epilogue(Jit* j){
+  bind(j, L_EXIT(j));
+  save_state(j);
+  op(j, 1, 0, 0, RSP, 0x83);
+  modrm(j, 3, ALU_ADD, RSP);
+  byte(j, 8);
+  pop_r(j, R15);
+  pop_r(j, R14);
+  pop_r(j, R13);
+  pop_r(j, R12);
+  pop_r(j, RBX);
+  pop_r(j, RBP);
+  byte(j, 0xC3);
+}
+
+static void emit_program(Jit* j){
+  j->len = 0;
+  emit_prologue(j);
+  load_vm(j, RAX, OFF(ip));
+  //an ip outside the program goes straight back, vm_step reports it
+  alu_ri(j, ALU_CMP, RAX, j->n);
+  jcc(j, CC_A, L_EXIT(j));
+  dispatch(j);
+
+  for(int b=0; b<j->cfg.nblocks; b++){
+    const CFGBlock *cb = &j->cfg.blocks[b];
+    j->block_off[b] = (int)j->len;
+    bind(j, LABEL(j, L_BLOCK, cb->start));
+    guard(j, cb->start);
+    for(int ip=cb->start; ip<cb->end; ip++){
+      bind(j, LABEL(j, L_BODY, ip));
+      emit_instr(j, ip);
+    }
+    //the next block follows in the buffer, only running off the program needs a jump
+    Operations term = cb->term >= 0 ? cfg_source_id(&j->program[cb->term]) : LBL;
+    if(cb->end == j->n && (cb->term < 0 || (term >= JE && term <= JLE))) jmp(j, L_END(j));
+  }
+  j->block_off[j->cfg.nblocks] = (int)j->len;
+
+  for(int ip=0; ip<j->n; ip++){
+    if(cfg_block_at(&j->cfg, ip) >= 0) continue;
+    bind(j, LABEL(j, L_MID, ip));
+    guard(j, ip);
+    jmp(j, LABEL(j, L_BODY, ip));
+  }
+  for(int ip=0; ip<j->n; ip++){
+    if(!j->used[LABEL(j, L_BACK, ip)]) continue;
+    bind(j, LABEL(j, L_BACK, ip));
+    if(cfg_source_id(&j->program[ip]) == RET){
+      back_edge(j, j->rest[ip], -1);
+      load_vm(j, RAX, OFF(ip));
+      jmp(j, LABEL(j, L_RESUME, ip));
+    }
+    else{
+      back_edge(j, j->rest[ip], j->program[ip].operand1.target);
+      jmp(j, entry_label(j, j->program[ip].operand1.target));
+    }
+  }
+  for(int ip=0; ip<j->n; ip++){
+    if(!j->used[LABEL(j, L_AT, ip)]) continue;
+    bind(j, LABEL(j, L_AT, ip));
+    alu_ri(j, ALU_SUB, R_STEPS, j->rest[ip]);
+    jmp(j, LABEL(j, L_BEFORE, ip));
+  }
+  for(int ip=0; ip<j->n; ip++){
+    if(!j->used[LABEL(j, L_BEFORE, ip)]) continue;
+    bind(j, LABEL(j, L_BEFORE, ip));
+    store_vm_imm(j, OFF(ip), ip);
+    jmp(j, L_EXIT(j));
+  }
+
+  bind(j, L_EXIT_EAX(j));
+  store_vm(j, OFF(ip), RAX);
+  jmp(j, L_EXIT(j));
+  bind(j, L_END(j));
+  store_vm_imm(j, OFF(ip), j->n);
+  emit_epilogue(j);
+}
+
+#if JIT_PERF_MAP
+static void write_perf_map(const Jit* j){
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE *f = fopen(path, "a");
+  if(!f) return;
+  uintptr_t base = (uintptr_t)j->buf;
+  fprintf(f, "%lx %x toyvm_jit_entry\n", (unsigned long)base, (unsigned)j->block_off[0]);
+  for(int b=0; b<j->cfg.nblocks; b++){
+    fprintf(f, "%lx %x toyvm_jit_ip%d\n", (unsigned long)(base + j->block_off[b]),
+            (unsigned)(j->block_off[b + 1] - j->block_off[b]), j->cfg.blocks[b].start);
+  }
+  fprintf(f, "%lx %x toyvm_jit_stubs\n", (unsigned long)(base + j->block_off[j->cfg.nblocks]),
+          (unsigned)(j->len - j->block_off[j->cfg.nblocks]));
+  fclose(f);
+}
+#endif
+
+bool jit_compile(const Instr* program, int program_size, JitProgram* out){
+  memset(out, 0, sizeof(JitProgram));
+  Jit j;
+  memset(&j, 0, sizeof(Jit));
+  j.program = program;
+  j.n = program_size;
+  if(program_size <= 0 || !cfg_build(program, program_size, &j.cfg)) return false;
+
+  bool ok = false;
+  j.nlabels = L_KINDS * (program_size + 1) + 3;
+  j.label = calloc(j.nlabels, sizeof(int));
+  j.used = calloc(j.nlabels, sizeof(bool));
+  j.rest = malloc(sizeof(int) * (program_size + 1));
+  j.block_off = malloc(sizeof(int) * (j.cfg.nblocks + 1));
+  j.table = malloc(sizeof(void*) * (program_size + 1));
+  if(!j.label || !j.used || !j.rest || !j.block_off || !j.table) goto done;
+
+  for(int b=0; b<j.cfg.nblocks; b++){
+    const CFGBlock *cb = &j.cfg.blocks[b];
+    int steps = 0;
+    for(int ip=cb->end - 1; ip>=cb->start; ip--){
+      steps += program[ip].steps;
+      j.rest[ip] = steps;
+    }
+  }
+
+  emit_program(&j);
+  size_t size = j.len;
+  void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(code == MAP_FAILED) goto done;
+  j.buf = code;
+  emit_program(&j);
+  if(j.len != size || mprotect(code, size, PROT_READ | PROT_EXEC) != 0){
+    munmap(code, size);
+    goto done;
+  }
+
+  for(int ip=0; ip<program_size; ip++) j.table[ip] = (uint8_t*)code + j.label[entry_label(&j, ip)];
+  j.table[program_size] = (uint8_t*)code + j.label[L_END(&j)];
+#if JIT_PERF_MAP
+  write_perf_map(&j);
+#endif
+
+  out->code = code;
+  out->code_size = size;
+  out->entry = (void (*)(VM*))code;
+  out->table = j.table;
+  out->program_size = program_size;
+  j.table = NULL;
+  ok = true;
+
+done:
+  free(j.label);
+  free(j.used);
+  free(j.rest);
+  free(j.block_off);
+  free(j.table);
+  cfg_free(&j.cfg);
+  return ok;
+}
+
+void jit_free(JitProgram* jp){
+  if(!jp) return;
+  if(jp->code) munmap(jp->code, jp->code_size);
+  free(jp->table);
+  memset(jp, 0, sizeof(JitProgram));
+}
+
+
+//TRACES
+
+typedef enum {SYM_MEM, SYM_IMM, SYM_REG, SYM_TMP} SymKind;
+
+//what a stack slot holds while a trace runs, anything but SYM_MEM hasn't been written to vm->stack yet
+typedef struct Sym{
+  SymKind kind;
+  int v; //immediate, VM register, or machine register
+} Sym;
+
+//free for stack values, rax/rcx/rdx belong to the templates
+static const int tmp_reg[] = {RSI, RDI, R11};
+#define NUM_TMP 3
+
+typedef struct TraceOp{
+  int ip;
+  Operations id; //source id, fused instructions are split into their components
+  int guard; //jumps: 1 recorded taken, 0 recorded falling through, -1 both land on the same ip
+} TraceOp;
+
+//VM state right before an op, what its side exit writes back
+typedef struct TraceExit{
+  bool set;
+  int depth;
+  int lo;
+  Sym *sym; //entries lo..depth
+} TraceExit;
+
+typedef struct TraceGen{
+  Jit *j;
+  const Instr *program;
+  const TraceOp *ops;
+  int nops;
+  int *prefix; //steps of the ops before k, prefix[nops] is one iteration
+  Sym *sym; //by depth relative to r10, which is the sp of the last flush
+  int depth;
+  int lo; //entries below lo and above depth are all SYM_MEM
+  bool tmp_used[NUM_TMP];
+  TraceExit *exits;
+  bool oom;
+} TraceGen;
+
+static int tmp_alloc(TraceGen* g){
+  for(int t=0; t<NUM_TMP; t++){
+    if(!g->tmp_used[t]){
+      g->tmp_used[t] = true;
+      return tmp_reg[t];
+    }
+  }
+  return -1;
+}
+
+static void tmp_release(TraceGen* g, Sym s){
+  if(s.kind != SYM_TMP) return;
+  for(int t=0; t<NUM_TMP; t++){
+    if(tmp_reg[t] == s.v) g->tmp_used[t] = false;
+  }
+}
+
+static inline Sym sym(SymKind kind, int v){
+  Sym s = {kind, v};
+  return s;
+}
+
+static void sym_set(TraceGen* g, int d, Sym s){
+  g->sym[d] = s;
+  if(d < g->lo) g->lo = d;
+}
+
+//value of the slot at depth d into r
+static void sym_load(Jit* j, int r, Sym s, int d){
+  switch(s.kind){
+    case SYM_IMM: mov_ri(j, r, s.v); break;
+    case SYM_REG: alu_rr(j, 0x89, r, vm_reg[s.v]); break;
+    case SYM_TMP: alu_rr(j, 0x89, r, s.v); break;
+    default: slot_op(j, 0x8B, r, 4 * d); break;
+  }
+}
+
+static void sym_store(Jit* j, Sym s, int d){
+  switch(s.kind){
+    case SYM_IMM: slot_store_imm(j, 4 * d, s.v); break;
+    case SYM_REG: slot_op(j, 0x89, vm_reg[s.v], 4 * d); break;
+    case SYM_TMP: slot_op(j, 0x89, s.v, 4 * d); break;
+    default: break;
+  }
+}
+
+//64-bit, r10 can be -1 under slots that are still addressed through it
+static void add_sp(Jit* j, int n){
+  if(n == 0) return;
+  op(j, 1, 0, 0, R_SP, 0x81);
+  modrm(j, 3, ALU_ADD, R_SP);
+  imm32(j, n);
+}
+
+//whole stack into memory and r10 to the real sp
+static void flush(TraceGen* g){
+  for(int d=g->lo; d<=g->depth; d++){
+    sym_store(g->j, g->sym[d], d);
+    tmp_release(g, g->sym[d]);
+    g->sym[d] = sym(SYM_MEM, 0);
+  }
+  add_sp(g->j, g->depth);
+  g->depth = 0;
+  g->lo = 1;
+}
+
+//leave right before op k when cc holds
+static void side_exit(TraceGen* g, int cc, int k){
+  TraceExit *x = &g->exits[k];
+  if(!x->set){
+    x->set = true;
+    x->depth = g->depth;
+    x->lo = g->lo;
+    x->sym = malloc(sizeof(Sym) * (g->depth >= g->lo ? g->depth - g->lo + 1 : 1));
+    if(!x->sym) g->oom = true;
+    else for(int d=g->lo; d<=g->depth; d++) x->sym[d - g->lo] = g->sym[d];
+  }
+  jcc(g->j, cc, LABEL(g->j, L_AT, k));
+}
+
+//a register about to change can't still stand for a value pushed earlier
+static void detach_reg(TraceGen* g, int r){
+  for(int d=g->lo; d<=g->depth; d++){
+    if(g->sym[d].kind != SYM_REG || g->sym[d].v != r) continue;
+    int t = tmp_alloc(g);
+    if(t >= 0){
+      alu_rr(g->j, 0x89, t, vm_reg[r]);
+      g->sym[d] = sym(SYM_TMP, t);
+    }
+    else{
+      sym_store(g->j, g->sym[d], d);
+      g->sym[d] = sym(SYM_MEM, 0);
+    }
+  }
+}
+
+static bool fold(Operations id, int a, int b, int* out){
+  uint32_t ua = (uint32_t)a, ub = (uint32_t)b;
+  switch(id){
+    case ADD: *out = (int)(ua + ub); return true;
+    case SUB: *out = (int)(ua - ub); return true;
+    case MUL: *out = (int)(ua * ub); return true;
+    default:
+      if(b == 0 || (a == INT32_MIN && b == -1)) return false;
+      *out = a / b;
+      return true;
+  }
+}
+
+static void trace_binary(TraceGen* g, int k, Operations id){
+  Jit *j = g->j;
+  int d = g->depth;
+  Sym a = g->sym[d - 1], b = g->sym[d];
+  int folded;
+  if(a.kind == SYM_IMM && b.kind == SYM_IMM && fold(id, a.v, b.v, &folded)){
+    g->sym[d] = sym(SYM_MEM, 0);
+    sym_set(g, d - 1, sym(SYM_IMM, folded));
+    g->depth--;
+    return;
+  }
+  if(id == DIV){
+    sym_load(j, RCX, b, d);
+    alu_rr(j, 0x85, RCX, RCX);
+    side_exit(g, CC_E, k);
+    sym_load(j, RAX, a, d - 1);
+    byte(j, 0x99); //cdq
+    op(j, 0, 0, 0, RCX, 0xF7);
+    modrm(j, 3, 7, RCX); //idiv ecx
+  }
+  else{
+    sym_load(j, RAX, a, d - 1);
+    if(b.kind == SYM_IMM){
+      if(id == MUL) imul_rri(j, RAX, RAX, b.v);
+      else alu_ri(j, id == ADD ? ALU_ADD : ALU_SUB, RAX, b.v);
+    }
+    else if(b.kind == SYM_MEM) slot_op(j, id == ADD ? 0x03 : id == SUB ? 0x2B : 0x0FAF, RAX, 4 * d);
+    else{
+      int src = (b.kind == SYM_REG) ? vm_reg[b.v] : b.v;
+      if(id == MUL){
+        op(j, 0, RAX, 0, src, 0x0FAF);
+        modrm(j, 3, RAX, src);
+      }
+      else alu_rr(j, id == ADD ? 0x01 : 0x29, RAX, src);
+    }
+  }
+  tmp_release(g, a);
+  tmp_release(g, b);
+  g->sym[d] = sym(SYM_MEM, 0);
+  g->depth--;
+  int t = tmp_alloc(g);
+  if(t >= 0){
+    alu_rr(j, 0x89, t, RAX);
+    sym_set(g, d - 1, sym(SYM_TMP, t));
+  }
+  else{
+    slot_op(j, 0x89, RAX, 4 * (d - 1));
+    sym_set(g, d - 1, sym(SYM_MEM, 0));
+  }
+}
+
+//a taken backward jump: everything goes to memory so vm_back_edge hashes the real state
+static void trace_back_edge(TraceGen* g, int k, int target){
+  if(!LOOP_CHECK) return;
+  flush(g);
+  back_edge(g->j, g->prefix[g->nops] - g->prefix[k], target);
+}
+
+static void trace_op(TraceGen* g, int k){
+  Jit *j = g->j;
+  const TraceOp *t = &g->ops[k];
+  const Instr *in = &g->program[t->ip];
+  switch(t->id){
+    case PSH:
+      g->depth++;
+      sym_set(g, g->depth, sym(SYM_IMM, in->operand1.value.imm));
+      break;
+    case LOAD:
+      g->depth++;
+      sym_set(g, g->depth, sym(SYM_REG, in->operand1.value.reg));
+      break;
+    case POP:
+      tmp_release(g, g->sym[g->depth]);
+      g->sym[g->depth] = sym(SYM_MEM, 0);
+      g->depth--;
+      break;
+    case ADD: case SUB: case MUL: case DIV:
+      trace_binary(g, k, t->id);
+      break;
+    case SET:
+    case INC:
+    case DEC: {
+      int r = in->operand1.value.reg;
+      detach_reg(g, r);
+      if(t->id == SET) mov_ri(j, vm_reg[r], in->operand2.value.imm);
+      else if(t->id == INC) inc_r(j, vm_reg[r]);
+      else dec_r(j, vm_reg[r]);
+      break;
+    }
+    case CMP:
+      cmp_flags(j, in);
+      break;
+    case JMP:
+      if(in->operand1.target <= t->ip) trace_back_edge(g, k, in->operand1.target);
+      break;
+    case JE: case JNE: case JG: case JGE: case JL: case JLE: {
+      if(t->guard < 0) break;
+      int cc = flags_taken(j, t->id);
+      //condition codes come in pairs, the low bit negates
+      side_exit(g, t->guard ? cc ^ 1 : cc, k);
+      if(t->guard && in->operand1.target <= t->ip) trace_back_edge(g, k, in->operand1.target);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+//stack bounds for one iteration, checked against the entry sp once at the loop head
+static void trace_bounds(const TraceOp* ops, int nops, int* min_base, int* max_base){
+  int depth = 0;
+  *min_base = -1;
+  *max_base = STACKSIZE - 1;
+  for(int k=0; k<nops; k++){
+    switch(ops[k].id){
+      case PSH: case LOAD:
+        if(STACKSIZE - 2 - depth < *max_base) *max_base = STACKSIZE - 2 - depth;
+        depth++;
+        break;
+      case POP:
+        if(-depth > *min_base) *min_base = -depth;
+        depth--;
+        break;
+      case ADD: case SUB: case MUL: case DIV:
+        if(1 - depth > *min_base) *min_base = 1 - depth;
+        depth--;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+static void emit_trace(TraceGen* g){
+  Jit *j = g->j;
+  int steps = g->prefix[g->nops];
+  int min_base, max_base;
+  trace_bounds(g->ops, g->nops, &min_base, &max_base);
+
+  j->len = 0;
+  g->depth = 0;
+  g->lo = 1;
+  memset(g->tmp_used, 0, sizeof(g->tmp_used));
+  emit_prologue(j);
+  //loop head, one iteration's MAXSTEPS and stack checks
+  bind(j, LABEL(j, L_BLOCK, 0));
+  alu_ri(j, ALU_ADD, R_STEPS, steps);
+  alu_ri(j, ALU_CMP, R_STEPS, MAXSTEPS);
+  side_exit(g, CC_GE, 0);
+  alu_ri(j, ALU_CMP, R_SP, min_base);
+  side_exit(g, CC_L, 0);
+  alu_ri(j, ALU_CMP, R_SP, max_base);
+  side_exit(g, CC_G, 0);
+  for(int k=0; k<g->nops; k++) trace_op(g, k);
+  flush(g);
+  jmp(j, LABEL(j, L_BLOCK, 0));
+
+  for(int k=0; k<g->nops; k++){
+    TraceExit *x = &g->exits[k];
+    if(!x->set || !x->sym) continue;
+    bind(j, LABEL(j, L_AT, k));
+    for(int d=x->lo; d<=x->depth; d++) sym_store(j, x->sym[d - x->lo], d);
+    add_sp(j, x->depth);
+    alu_ri(j, ALU_SUB, R_STEPS, steps - g->prefix[k]);
+    store_vm_imm(j, OFF(ip), g->ops[k].ip);
+    jmp(j, L_EXIT(j));
+  }
+  emit_epilogue(j);
+}
+
+static void free_exits(TraceGen* g){
+  for(int k=0; k<g->nops; k++) free(g->exits[k].sym);
+  memset(g->exits, 0, sizeof(TraceExit) * g->nops);
+}
+
+static int fused_width(Operations id){
+  for(int k=0; k<fusion_table_size; k++){
+    if(fusion_table[k].fused == id) return fusion_table[k].width;
+  }
+  return 1;
+}
+
+//path holds the ips the interpreter stepped through from head around to head again
+static bool trace_compile(TraceCache* tc, const Instr* program, const int* path, int len, int head){
+  TraceOp *ops = malloc(sizeof(TraceOp) * len * MAX_FUSION_WIDTH);
+  if(!ops) return false;
+  int nops = 0;
+  for(int p=0; p<len; p++){
+    int width = fused_width(program[path[p]].ID);
+    for(int c=0; c<width; c++){
+      ops[nops].ip = path[p] + c;
+      ops[nops].id = cfg_source_id(&program[path[p] + c]);
+      ops[nops].guard = -1;
+      nops++;
+    }
+  }
+
+  //each op has to lead to the next one recorded, jumps get the direction they went
+  bool ok = true;
+  for(int k=0; k<nops && ok; k++){
+    const Instr *in = &program[ops[k].ip];
+    int next = (k + 1 < nops) ? ops[k + 1].ip : head;
+    int target = in->operand1.target;
+    switch(ops[k].id){
+      case PSH: case POP: case ADD: case SUB: case MUL: case DIV: case LBL:
+        ok = (next == ops[k].ip + 1);
+        break;
+      case LOAD: case SET: case INC: case DEC:
+        ok = (next == ops[k].ip + 1) && valid_reg(in->operand1.value.reg);
+        break;
+      case CMP:
+        ok = (next == ops[k].ip + 1);
+        for(int o=0; o<2 && ok; o++){
+          Operand v = o ? in->operand2 : in->operand1;
+          ok = v.type == IMM || (v.type == REG && valid_reg(v.value.reg));
+        }
+        break;
+      case JMP:
+        ok = (next == target);
+        break;
+      case JE: case JNE: case JG: case JGE: case JL: case JLE:
+        if(target == ops[k].ip + 1) ops[k].guard = -1;
+        else if(next == target) ops[k].guard = 1;
+        else if(next == ops[k].ip + 1) ops[k].guard = 0;
+        else ok = false;
+        break;
+      default:
+        ok = false;
+        break;
+    }
+  }
+
+  Jit j;
+  TraceGen g;
+  memset(&j, 0, sizeof(Jit));
+  memset(&g, 0, sizeof(TraceGen));
+  j.n = nops;
+  j.nlabels = L_KINDS * (nops + 1) + 3;
+  g.j = &j;
+  g.program = program;
+  g.ops = ops;
+  g.nops = nops;
+  Sym *sym_storage = NULL;
+  void *code = MAP_FAILED;
+  size_t size = 0;
+  if(ok){
+    j.label = calloc(j.nlabels, sizeof(int));
+    j.used = calloc(j.nlabels, sizeof(bool));
+    g.prefix = malloc(sizeof(int) * (nops + 1));
+    g.exits = calloc(nops + 1, sizeof(TraceExit));
+    //depth stays within nops of the loop head either way, same bounds as reg_translate
+    sym_storage = malloc(sizeof(Sym) * (2 * nops + 5));
+    ok = j.label && j.used && g.prefix && g.exits && sym_storage;
+  }
+  if(ok){
+    g.sym = sym_storage + nops + 2;
+    for(int d=-nops - 2; d<=nops + 2; d++) g.sym[d] = sym(SYM_MEM, 0);
+    g.prefix[0] = 0;
+    for(int k=0; k<nops; k++) g.prefix[k + 1] = g.prefix[k] + program[ops[k].ip].steps;
+
+    emit_trace(&g);
+    free_exits(&g);
+    size = j.len;
+    code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ok = !g.oom && code != MAP_FAILED;
+  }
+  if(ok){
+    j.buf = code;
+    emit_trace(&g);
+    ok = !g.oom && j.len == size && mprotect(code, size, PROT_READ | PROT_EXEC) == 0;
+    if(!ok) munmap(code, size);
+  }
+  if(ok){
+    tc->entry[head] = (void (*)(VM*))code;
+    tc->code_size[head] = size;
+#if JIT_PERF_MAP
+    char path_name[64];
+    snprintf(path_name, sizeof(path_name), "/tmp/perf-%d.map", (int)getpid());
+    FILE *f = fopen(path_name, "a");
+    if(f){
+      fprintf(f, "%lx %x toyvm_trace_ip%d\n", (unsigned long)(uintptr_t)code, (unsigned)size, head);
+      fclose(f);
+    }
+#endif
+  }
+
+  if(g.exits) free_exits(&g);
+  free(g.exits);
+  free(g.prefix);
+  free(sym_storage);
+  free(j.label);
+  free(j.used);
+  free(ops);
+  return ok;
+}
+
+bool trace_cache_init(TraceCache* tc, int program_size){
+  memset(tc, 0, sizeof(TraceCache));
+  tc->hits = calloc(program_size + 1, sizeof(int));
+  tc->entry = calloc(program_size + 1, sizeof(*tc->entry));
+  tc->code_size = calloc(program_size + 1, sizeof(size_t));
+  tc->program_size = program_size;
+  if(!tc->hits || !tc->entry || !tc->code_size){
+    trace_cache_free(tc);
+    return false;
+  }
+  return true;
+}
+
+void trace_cache_free(TraceCache* tc){
+  if(!tc) return;
+  for(int ip=0; tc->entry && ip<tc->program_size; ip++){
+    if(tc->entry[ip]) munmap((void*)tc->entry[ip], tc->code_size[ip]);
+  }
+  free(tc->hits);
+  free(tc->entry);
+  free(tc->code_size);
+  memset(tc, 0, sizeof(TraceCache));
+}
+
+//runs the loop at head once more through the interpreter, taking down every ip it steps on. the run is real,
+//giving up halfway leaves the VM wherever it got to
+static bool trace_record(VM* vm, TraceCache* tc, int head){
+  int path[TRACE_MAX];
+  int len = 0;
+  while(len < TRACE_MAX){
+    int ip = vm->ip;
+    if(ip < 0 || ip >= vm->program_size) return false;
+    Operations id = cfg_source_id(&vm->program[ip]);
+    if(id == CALL || id == RET || id == HLT) return false;
+    path[len++] = ip;
+    vm_step(vm, NULL);
+    if(!vm->running || vm->error != ERR_OK) return false;
+    if(vm->ip == head) return trace_compile(tc, vm->program, path, len, head);
+  }
+  return false;
+}
+
+#else
+
+bool jit_compile(const Instr* program, int program_size, JitProgram* out){
+  (void)program;
+  (void)program_size;
+  memset(out, 0, sizeof(JitProgram));
+  return false;
+}
+
+void jit_free(JitProgram* jp){
+  if(jp) memset(jp, 0, sizeof(JitProgram));
+}
+
+
+bool trace_cache_init(TraceCache* tc, int program_size){
+  (void)program_size;
+  memset(tc, 0, sizeof(TraceCache));
+  return false;
+}
+
+void trace_cache_free(TraceCache* tc){
+  if(tc) memset(tc, 0, sizeof(TraceCache));
+}
+
+static bool trace_record(VM* vm, TraceCache* tc, int head){
+  (void)vm;
+  (void)tc;
+  (void)head;
+  return false;
+}
+
+#endif
+
+//compiled code returns whenever the interpreter has to run the next instruction, one vm_step and it goes back in
+void vm_run_jit(VM* vm, VMTraceFunc trace){
+  const JitProgram *jp = vm->jit;
+  if(trace || !jp || !jp->entry){
+    vm_run(vm, trace);
+    return;
+  }
+  while(vm->running && vm->error == ERR_OK){
+    jp->entry(vm);
+    if(!vm->running || vm->error != ERR_OK) break;
+    vm_step(vm, NULL);
+  }
+}
+
+//interprets and counts taken backward jumps per target ip, a loop head that gets hot is recorded and compiled.
+//after a trace returns at least one instruction is interpreted, so a trace leaving at its head can't spin
+void vm_run_traces(VM* vm, VMTraceFunc trace){
+  TraceCache *tc = vm->traces;
+  if(trace || !tc || !tc->hits){
+    vm_run(vm, trace);
+    return;
+  }
+  while(vm->running){
+    int ip = vm->ip;
+    if(ip >= 0 && ip < tc->program_size && tc->entry[ip]){
+      tc->entry[ip](vm);
+      if(!vm->running || vm->error != ERR_OK) return;
+      ip = vm->ip;
+    }
+    vm_step(vm, NULL);
+    if(!vm->running || vm->error != ERR_OK) return;
+    int head = vm->ip;
+    if(head > ip || head < 0 || tc->entry[head] || tc->hits[head] < 0) continue;
+    if(++tc->hits[head] >= TRACE_HOT && !trace_record(vm, tc, head)) tc->hits[head] = -1;
+  }
+}
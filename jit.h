@@ -0,0 +1,52 @@
+#ifndef JIT_H
+#define JIT_H
+#include"header.h"
+
+//baseline template JIT for x86-64 Linux: every instruction becomes a fixed native sequence and labels become
+//jumps between CFG blocks, MAXSTEPS is checked once per block like vm_run_regs. registers A-E live in
+//rbx/r12-r15 and sp in r10, the stacks, flags and callstack stay in the VM. an instruction that would fault, or
+//that the JIT has no template for, leaves through a stub that puts the VM right before it and vm_run_jit
+//steps it through its handler, so errors, error ips and counts are the interpreter's
+
+#define JIT_PERF_MAP 0 //1: append each compiled program's blocks to /tmp/perf-PID.map so perf can name the frames
+
+typedef struct JitProgram{
+  void *code; //mmap'd, read+exec once compiled
+  size_t code_size;
+  void (*entry)(VM* vm); //runs from vm->ip until HLT, a fault or something left to the interpreter
+  void **table; //ip -> native entry point, program_size + 1 entries (the last one is running off the end)
+  int program_size;
+} JitProgram;
+
+//false off x86-64 Linux or when out of memory, vm_run_jit then interprets
+bool jit_compile(const Instr* program, int program_size, JitProgram* out);
+void jit_free(JitProgram* jp);
+
+//vm->jit has to be compiled from vm->program. with a trace attached, or no compiled code, it's vm_run
+void vm_run_jit(VM* vm, VMTraceFunc trace);
+
+//trace JIT: only hot loops get compiled. vm_run_traces counts taken backward jumps per target, and once a target
+//has TRACE_HOT of them the interpreter records its next trip around the loop. that path is compiled with the
+//stack kept symbolic inside an iteration (psh/load/pop pairs never touch memory), bounds and MAXSTEPS checked
+//once per iteration at the loop head, and a guard on every Jcc. a guard that fails writes the stack back and
+//leaves right before its instruction, the interpreter carries on from there. loops that CALL, RET or HLT,
+//or take longer than TRACE_MAX steps around, stay interpreted
+
+#define TRACE_HOT 64 //taken backward jumps into an ip before the loop there is recorded
+#define TRACE_MAX 64 //steps one recorded iteration may take
+
+typedef struct TraceCache{
+  int *hits; //per ip, -1 once recording or compiling there gave up
+  void (**entry)(VM* vm); //per ip, the compiled loop starting there
+  size_t *code_size;
+  int program_size;
+} TraceCache;
+
+//the cache belongs to one program and keeps its traces across runs. false off x86-64 Linux or out of memory
+bool trace_cache_init(TraceCache* tc, int program_size);
+void trace_cache_free(TraceCache* tc);
+
+//vm->traces has to be set up for vm->program. with a trace attached, or no cache, it's vm_run
+void vm_run_traces(VM* vm, VMTraceFunc trace);
+
+#endif
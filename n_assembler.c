@@ -37,6 +37,39 @@ Instr_template lookup[OPCODE]= {
 const char* operation_names[] = {
   "psh", "add", "sub", "mul", "div", "pop", "set", "load", "hlt", "label", "jmp", "je", "jne", "jg", "jge", "jl", "jle", "cmp", "call", "ret", "inc", "dec"
 } ;
+//widest patterns first, matching is greedy left to right. components after the first must never be
+//jump or return targets, so patterns can't contain LBL or CALL past their first slot
+FusionRule fusion_table[] = {
+  {PSH_PSH_ADD, 3, {PSH, PSH, ADD}, instr_psh_psh_add},
+  {PSH_PSH_SUB, 3, {PSH, PSH, SUB}, instr_psh_psh_sub},
+  {PSH_PSH_MUL, 3, {PSH, PSH, MUL}, instr_psh_psh_mul},
+  {PSH_PSH_DIV, 3, {PSH, PSH, DIV}, instr_psh_psh_div},
+  {LOAD_LOAD_ADD, 3, {LOAD, LOAD, ADD}, instr_load_load_add},
+  {LOAD_LOAD_SUB, 3, {LOAD, LOAD, SUB}, instr_load_load_sub},
+  {LOAD_LOAD_MUL, 3, {LOAD, LOAD, MUL}, instr_load_load_mul},
+  {LOAD_LOAD_DIV, 3, {LOAD, LOAD, DIV}, instr_load_load_div},
+  {CMP_JE, 2, {CMP, JE}, instr_cmp_je},
+  {CMP_JNE, 2, {CMP, JNE}, instr_cmp_jne},
+  {CMP_JG, 2, {CMP, JG}, instr_cmp_jg},
+  {CMP_JGE, 2, {CMP, JGE}, instr_cmp_jge},
+  {CMP_JL, 2, {CMP, JL}, instr_cmp_jl},
+  {CMP_JLE, 2, {CMP, JLE}, instr_cmp_jle}
+};
+const int fusion_table_size = sizeof(fusion_table) / sizeof(fusion_table[0]);
+
+UncheckedRule unchecked_table[] = {
+  {PSH, PSH_NC, instr_psh_nc},
+  {ADD, ADD_NC, instr_add_nc},
+  {SUB, SUB_NC, instr_sub_nc},
+  {MUL, MUL_NC, instr_mul_nc},
+  {DIV, DIV_NC, instr_div_nc},
+  {POP, POP_NC, instr_pop_nc},
+  {LOAD, LOAD_NC, instr_load_nc},
+  {CALL, CALL_NC, instr_call_nc},
+  {RET, RET_NC, instr_ret_nc}
+};
+const int unchecked_table_size = sizeof(unchecked_table) / sizeof(unchecked_table[0]);
+
 //general purpose aid function
 
 void trim(char *str){
@@ -59,7 +92,22 @@ int reg_from_char(char*st){
   return s -'A';
 }
 
-bool assess_number(char* op, int *out){
+//assembler errors don't exit: the first one is kept in the result and every step after it bails out
+static bool asm_error(AsmResult* res, Errors err, int line, const char* token, const char* detail){
+  if(res->error != ERR_OK) return false;
+  res->error = err;
+  res->line = line;
+  res->token[0] = '\0';
+  if(token){
+    strncpy(res->token, token, sizeof(res->token) - 1);
+    res->token[sizeof(res->token) - 1] = '\0';
+  }
+  res->has_token = (token != NULL);
+  res->detail = detail;
+  return false;
+}
+
+bool assess_number(char* op, int *out, int line, AsmResult* res){
   if(!op || !out) return false;
   char *token;
   long val = strtol(op, &token, 10);
@@ -67,7 +115,7 @@ bool assess_number(char* op, int *out){
     return false;
   }
   if(val > INT_MAX || val < INT_MIN){
-    report_asm_error(ERR_INVALID_LITERAL, 72, op, "Not a valid integer");
+    return asm_error(res, ERR_INVALID_LITERAL, line, op, "Not a valid integer");
   }
 
   *out = (int)val;
@@ -75,13 +123,13 @@ bool assess_number(char* op, int *out){
 }
  
 
-int parse_operand(char*token){
+int parse_operand(char*token, int line, AsmResult* res){
   if(!token){
       return OP_NONE;
   }
   int num;
 
-  if(assess_number(token, &num)){
+  if(assess_number(token, &num, line, res)){
       return OP_IMM;
   }
 
@@ -95,26 +143,33 @@ int parse_operand(char*token){
         return OP_LABEL;
     }
   }
-  report_asm_error(ERR_INVALID_TOKEN, 101, token, "Input Operand invalid");
+  asm_error(res, ERR_INVALID_TOKEN, line, token, "Input Operand invalid");
+  return -1;
 }
 
-
 //assembler step aid function: these are their own steps in their architecture, but for readability are implemented inside other functions 
 //
 
-char* lex_clean_line(const char* line) {
-  if(!line) report_asm_error(ERR_ALLOC_FAIL, 110, line, "Issue with memory allocation");
+char* lex_clean_line(const char* line, int line_no, AsmResult* res) {
+  if(!line){
+    asm_error(res, ERR_ALLOC_FAIL, line_no, line, "Issue with memory allocation");
+    return NULL;
+  }
   size_t line_len = strlen(line);
   for (size_t i = 0; i < line_len; i++) {
     if (line[i] == '\0' && i < line_len - 1) {
-      report_asm_error(ERR_INVALID_TOKEN, 0, NULL, "Null byte in input");
+      asm_error(res, ERR_INVALID_TOKEN, line_no, NULL, "Null byte in input");
+      return NULL;
     }
   }
   const char* comment_pos = strchr(line, ';');
   size_t useful_len = comment_pos ? (size_t)(comment_pos - line) : strlen(line);
     
   char* result = malloc(useful_len + 1);
-  if(!result) report_asm_error(ERR_ALLOC_FAIL, 110, line, "Issue with memory allocation");
+  if(!result){
+    asm_error(res, ERR_ALLOC_FAIL, line_no, line, "Issue with memory allocation");
+    return NULL;
+  }
     
   int write_pos = 0;
   bool prev_space = false;
@@ -146,8 +201,8 @@ if (write_pos == 0) {
 
 
 
-bool isValidInstruction(char**words, int *index){
-  if(!words || !words[0]) report_asm_error(ERR_SYNTAX, 148, *words, "token is empty");
+bool isValidInstruction(char**words, int *index, int line, AsmResult* res){
+  if(!words || !words[0]) return asm_error(res, ERR_SYNTAX, line, NULL, "token is empty");
 
   int word_count = 0;
   int found_opcode = -1;
@@ -166,20 +221,20 @@ bool isValidInstruction(char**words, int *index){
 
   if(word_count == 0) return false;
   if(found_opcode == -1){
-    report_asm_error(ERR_UNKNOWN_OPCODE, 190, words[0], "unknwon instruction");
+    return asm_error(res, ERR_UNKNOWN_OPCODE, line, words[0], "unknwon instruction");
   }
    //part where we validate operands 
   Instr_template operation_beta = lookup[found_opcode];
 
   int n_operands = word_count - 1;
    if(n_operands < operation_beta.min_operand){
-    report_asm_error(ERR_TOO_FEW_OPERANDS, 167, words[0], "Operand count is too low for instruction used");
+    return asm_error(res, ERR_TOO_FEW_OPERANDS, line, words[0], "Operand count is too low for instruction used");
   } else if ( n_operands > operation_beta.max_operand){    
-    report_asm_error(ERR_TOO_MANY_OPERANDS, 170, words[0], "Operand count too high for instruction used");
+    return asm_error(res, ERR_TOO_MANY_OPERANDS, line, words[0], "Operand count too high for instruction used");
   }
 
   for(int i=0; i<n_operands; i++){
-    int operand_type = parse_operand(words[i+1]);  // words[0] is opcode, words[1+] are operands
+    int operand_type = parse_operand(words[i+1], line, res);  // words[0] is opcode, words[1+] are operands
       
     if(operand_type == -1) {
       return false;
@@ -196,63 +251,105 @@ bool isValidInstruction(char**words, int *index){
 
 
 
+//fgets over a memory buffer, so long lines are cut into the same chunks as when reading the file
+static bool buffer_gets(char* buf, int size, const char** cur, const char* end){
+  if(*cur >= end) return false;
+  int n = 0;
+  while(n < size - 1 && *cur < end){
+    char c = *(*cur)++;
+    buf[n++] = c;
+    if(c == '\n') break;
+  }
+  buf[n] = '\0';
+  return true;
+}
 
-char** split_lines(FILE* file, int *out){
-  if(!file || !out){
-    report_asm_error(ERR_IO, 199, NULL, "File entering hasn't been passed properly");
+//line_numbers gets the 1-based source line of every kept line
+char** split_lines(const char* src, size_t len, int *out, int *line_numbers, AsmResult* res){
+  if(!src || !out){
+    asm_error(res, ERR_IO, 0, NULL, "File entering hasn't been passed properly");
+    return NULL;
   }
   char **lines = malloc(sizeof(char*) * MAX_LINES);
   if(!lines){
-    report_asm_error(ERR_ALLOC_FAIL, 204, NULL, "Memory allocation for line failed");
+    asm_error(res, ERR_ALLOC_FAIL, 0, NULL, "Memory allocation for line failed");
+    return NULL;
   }
 
   char buffer[MAX_LINES_LENGTH];
-    int count = 0;
-
-  while(fgets(buffer, sizeof(buffer), file) && count<MAX_LINES){
+  const char *cur = src;
+  const char *end = src + len;
+  int count = 0;
+  int line_no = 0;
 
+  while(buffer_gets(buffer, sizeof(buffer), &cur, end) && count<MAX_LINES){
+  line_no++;
   size_t len = strlen(buffer);
     if(len == sizeof(buffer) - 1 && buffer[len - 1] != '\n'){
-      report_asm_error(ERR_LINE_TOO_LONG, 209, buffer, "Line is longer than limit size");
+      asm_error(res, ERR_LINE_TOO_LONG, line_no, buffer, "Line is longer than limit size");
+      break;
     }
-    char* cleaned_lines = lex_clean_line(buffer);
+    char* cleaned_lines = lex_clean_line(buffer, line_no, res);
+    if(res->error != ERR_OK) break;
     if(!cleaned_lines){
       continue;
     }
+    line_numbers[count] = line_no;
     lines[count++] = cleaned_lines;
   }
 
+  if(res->error != ERR_OK){
+    for(int i = 0; i < count; i++) free(lines[i]);
+    free(lines);
+    return NULL;
+  }
   *out = count;
   return lines;
 }
 
-#define MAX_TOKEN_LENGTH 64
+void free_tokens(char** tokens) {
+    if(!tokens) return;
+    
+    for(int i = 0; tokens[i] != NULL; i++) {
+        free(tokens[i]);
+    }
+    free(tokens);
+}
+
 
-char** tokenizer(char*beta_token){
+
+char** tokenizer(char*beta_token, int line, AsmResult* res){
   
-  if(!beta_token) report_asm_error(ERR_IO, 199, NULL, "File entering hasn't been passed properly");
-;
+  if(!beta_token){
+    asm_error(res, ERR_IO, line, NULL, "File entering hasn't been passed properly");
+    return NULL;
+  }
   const int max_token = 4;
   char **words = malloc(sizeof(char*) * (max_token + 1));
   if(!words){
-    report_asm_error(ERR_ALLOC_FAIL, 204, NULL, "Memory allocation for line failed");
-   
+    asm_error(res, ERR_ALLOC_FAIL, line, NULL, "Memory allocation for line failed");
+    return NULL;
   }
 
   for(int i = 0; i < max_token + 1; i++) words[i] = NULL;
 
   int count = 0;
-  char*token = strtok(beta_token, " ");
+  char *save = NULL;
+  char*token = strtok_r(beta_token, " ", &save);
 
   while(token != NULL && count< max_token){
-    if(strlen(token) >= MAX_TOKEN_LENGTH) report_asm_error(ERR_TOKEN_TOO_LONG, 243, NULL, "Token exceeds maximum length");
+    if(strlen(token) >= MAX_TOKEN_LENGTH){
+      free_tokens(words);
+      asm_error(res, ERR_TOKEN_TOO_LONG, line, NULL, "Token exceeds maximum length");
+      return NULL;
+    }
     words[count] = strdup(token);
     if(!words[count]){
-      for(int i = 0; i < count; i++) free(words[i]);
-        free(words);
-        report_asm_error(ERR_ALLOC_FAIL, 247, NULL, "strdup failed in tokenizer");
+      free_tokens(words);
+      asm_error(res, ERR_ALLOC_FAIL, line, NULL, "strdup failed in tokenizer");
+      return NULL;
     }
-    token = strtok(NULL, " ");
+    token = strtok_r(NULL, " ", &save);
     count++;
   }
 
@@ -262,29 +359,31 @@ char** tokenizer(char*beta_token){
   }
 
   if(count > 3){
-    for(int i = 0; i < count; i++) free(words[i]);
-    free(words);
-    report_asm_error(ERR_TOO_MANY_OPERANDS, 259, beta_token, "Too many words in instruction");
+    free_tokens(words);
+    asm_error(res, ERR_TOO_MANY_OPERANDS, line, beta_token, "Too many words in instruction");
+    return NULL;
     }
   return words;
 }
 
 
 
-Instr Encoder(char**validated_words){
+bool Encoder(char**validated_words, Instr* alpha_instr, int line, AsmResult* res){
 
   int index = -1;
 
-  if(!isValidInstruction(validated_words, &index)) report_asm_error(ERR_INVALID_TOKEN, 273, *validated_words, "Input Instruction is not valid");
+  if(!isValidInstruction(validated_words, &index, line, res)) return asm_error(res, ERR_INVALID_TOKEN, line, *validated_words, "Input Instruction is not valid");
  
-  if(index == -1) report_asm_error(ERR_INVALID_TOKEN, 272, validated_words[0], "Instruction not valid");
+  if(index == -1) return asm_error(res, ERR_INVALID_TOKEN, line, validated_words[0], "Instruction not valid");
 
-  Instr alpha_instr;
-  alpha_instr.ID = lookup[index].ID;
-  alpha_instr.execute = lookup[index].execute;
+  alpha_instr->ID = lookup[index].ID;
+  alpha_instr->execute = lookup[index].execute;
+  alpha_instr->steps = 1;
 
-  alpha_instr.operand1.type = NONE;
-  alpha_instr.operand2.type = NONE;
+  alpha_instr->operand1.type = NONE;
+  alpha_instr->operand2.type = NONE;
+  alpha_instr->operand1.target = -1;
+  alpha_instr->operand2.target = -1;
 
   int operand_count = 0;
   while(validated_words[operand_count] != NULL){
@@ -296,15 +395,15 @@ Instr Encoder(char**validated_words){
       char* op1 = validated_words[1];
       int num_val;
         
-      if(assess_number(op1, &num_val)) {
-        alpha_instr.operand1.type = IMM;
-        alpha_instr.operand1.value.imm = num_val;
+      if(assess_number(op1, &num_val, line, res)) {
+        alpha_instr->operand1.type = IMM;
+        alpha_instr->operand1.value.imm = num_val;
       } else if(reg_from_char(op1) >= 0) {
-        alpha_instr.operand1.type = REG;
-        alpha_instr.operand1.value.reg = reg_from_char(op1);
+        alpha_instr->operand1.type = REG;
+        alpha_instr->operand1.value.reg = reg_from_char(op1);
       } else if(strlen(op1) > 1) {
-        alpha_instr.operand1.type = LABEL;
-        alpha_instr.operand1.value.label = strdup(op1);
+        alpha_instr->operand1.type = LABEL;
+        alpha_instr->operand1.value.label = strdup(op1);
       }
     }
 
@@ -312,31 +411,20 @@ Instr Encoder(char**validated_words){
     char* op2 = validated_words[2];
     int num_val;
         
-    if(assess_number(op2, &num_val)) {
-      alpha_instr.operand2.type = IMM;
-      alpha_instr.operand2.value.imm = num_val;
+    if(assess_number(op2, &num_val, line, res)) {
+      alpha_instr->operand2.type = IMM;
+      alpha_instr->operand2.value.imm = num_val;
     } else if(reg_from_char(op2) >= 0) {
-      alpha_instr.operand2.type = REG;
-      alpha_instr.operand2.value.reg = reg_from_char(op2);
+      alpha_instr->operand2.type = REG;
+      alpha_instr->operand2.value.reg = reg_from_char(op2);
     } else if(strlen(op2) > 1) {
-      alpha_instr.operand2.type = LABEL;
-      alpha_instr.operand2.value.label = strdup(op2);
+      alpha_instr->operand2.type = LABEL;
+      alpha_instr->operand2.value.label = strdup(op2);
     }
   }
     
-  return alpha_instr;
-    
-}
-
-
-
-void free_tokens(char** tokens) {
-    if(!tokens) return;
+  return true;
     
-    for(int i = 0; tokens[i] != NULL; i++) {
-        free(tokens[i]);
-    }
-    free(tokens);
 }
 
 
@@ -354,28 +442,40 @@ void free_program(Instr* program, int program_size) {
     free(program); // finally free the whole array
 }
 
-Label* parse_labels(Instr* program, int program_size, int*out_lb_count, int max_labels){
+//label errors carry the instruction index, assemble_buffer maps it back to the source line
+Label* parse_labels(Instr* program, int program_size, int*out_lb_count, int max_labels, AsmResult* res){
   *out_lb_count = 0;
-  if(program_size < 1 || max_labels < 1) report_asm_error(ERR_IO, 350, NULL, "Program or Max labels improperly allocated");
+  if(program_size < 1 || max_labels < 1){
+    asm_error(res, ERR_IO, -1, NULL, "Program or Max labels improperly allocated");
+    return NULL;
+  }
   Label* temp_lb_array = malloc(sizeof(Label) * max_labels);
-  if(!temp_lb_array) report_asm_error(ERR_ALLOC_FAIL, 352, NULL, "Label array allocation failed");
+  if(!temp_lb_array){
+    asm_error(res, ERR_ALLOC_FAIL, -1, NULL, "Label array allocation failed");
+    return NULL;
+  }
   int lb_index = 0;
   for(int i=0; i<program_size; i++){
     if (program[i].ID == LBL){
       for(int j=0; j<lb_index; j++){
         if(strcmp(temp_lb_array[j].name, program[i].operand1.value.label) == 0){
-          report_asm_error(ERR_DUPLICATE_LABEL, i, temp_lb_array[j].name, "Label has a duplicate declared in code");
+          asm_error(res, ERR_DUPLICATE_LABEL, i, temp_lb_array[j].name, "Label has a duplicate declared in code");
+          free(temp_lb_array);
+          return NULL;
         }
       }
       if(lb_index == max_labels){
         free(temp_lb_array);
-        report_asm_error(ERR_TOO_MANY_LABELS, 364, NULL, "Too many labels defined in code");
+        asm_error(res, ERR_TOO_MANY_LABELS, i, NULL, "Too many labels defined in code");
+        return NULL;
       }
       const char* label_name = program[i].operand1.value.label;
       size_t label_len = strlen(label_name);
 
       if(label_len >= sizeof(temp_lb_array[lb_index].name)){
-        report_asm_error(ERR_LABEL_TOO_LONG, 373, label_name, "Label is too long");
+        asm_error(res, ERR_LABEL_TOO_LONG, i, label_name, "Label is too long");
+        free(temp_lb_array);
+        return NULL;
       }
       strncpy(temp_lb_array[lb_index].name, label_name, sizeof(temp_lb_array[lb_index].name) - 1);
       temp_lb_array[lb_index].name[sizeof(temp_lb_array[lb_index].name) - 1] = '\0';
@@ -392,59 +492,165 @@ Label* parse_labels(Instr* program, int program_size, int*out_lb_count, int max_
     }
   }
   if(!has_halt){
-    report_asm_error(ERR_MISSING_HALT, 391, "halt", "Program missing a halt.");
+    free(temp_lb_array);
+    asm_error(res, ERR_MISSING_HALT, -1, "halt", "Program missing a halt.");
+    return NULL;
   }
   *out_lb_count = lb_index;
   return temp_lb_array;
 }
 
+//link step: every LABEL operand gets the index of its declaration so jumps don't search by name at runtime
+bool link_labels(Instr* program, int program_size, const Label* labels, int label_count, AsmResult* res){
+  for(int i=0; i<program_size; i++){
+    Operand *op = &program[i].operand1;
+    if(op->type != LABEL) continue;
+
+    op->target = -1;
+    for(int j=0; j<label_count; j++){
+      if(strcmp(labels[j].name, op->value.label) == 0){
+        op->target = labels[j].address;
+        break;
+      }
+    }
+    if(op->target == -1){
+      return asm_error(res, ERR_UNRESOLVED_LABEL, i, op->value.label, "Label used is never declared");
+    }
+  }
+  return true;
+}
 
 
-void define_program(Instr **out_program, int *out_size, Label **out_labels, int *out_label_count) {
+
+//Phase 5 (optional): superinstruction fusion. only the first component is rewritten, the others stay in
+//place so the fused handler can read their operands and ip keeps counting source lines.
+//fused handlers count one step per component, instructions optimize_program gave more steps aren't fused
+int fuse_program(Instr* program, int program_size){
+  int fused = 0;
+  for(int i=0; i<program_size; i++){
+    for(int r=0; r<fusion_table_size; r++){
+      const FusionRule *rule = &fusion_table[r];
+      if(i + rule->width > program_size) continue;
+
+      bool match = true;
+      for(int k=0; k<rule->width; k++){
+        if(program[i+k].ID != rule->pattern[k] || program[i+k].steps != 1){
+          match = false;
+          break;
+        }
+      }
+      if(!match) continue;
+
+      program[i].ID = rule->fused;
+      program[i].execute = rule->execute;
+      i += rule->width - 1;
+      fused++;
+      break;
+    }
+  }
+  return fused;
+}
+
+//Phase 5 (optional): packed encoding of an already linked program
+Errors emit_bytecode(const Instr* program, int program_size, BytecodeProgram* out){
+  out->code = NULL;
+  out->consts = NULL;
+  out->size = 0;
+  out->const_count = 0;
+  if(!program || program_size < 1) return ERR_EMPTY_PROGRAM;
+
+  out->code = malloc(sizeof(Bytecode) * program_size);
+  out->consts = malloc(sizeof(int) * program_size);
+  if(!out->code || !out->consts){
+    free_bytecode(out);
+    return ERR_ALLOC_FAIL;
+  }
+
+  for(int i=0; i<program_size; i++){
+    const Operand *op1 = &program[i].operand1;
+    const Operand *op2 = &program[i].operand2;
+    int reg = 0;
+    int imm = 0;
+
+    //second operand owns the 32-bit field when there is one, the first one is squeezed into the register byte
+    const Operand *wide = (op2->type != NONE) ? op2 : op1;
+    switch(wide->type){
+      case IMM: imm = wide->value.imm; break;
+      case REG: imm = wide->value.reg; break;
+      case LABEL: imm = wide->target; break;
+      case NONE: break;
+    }
+    if(op2->type != NONE || op1->type == REG){
+      if(op1->type == REG){
+        reg = op1->value.reg;
+      } else if(op1->type == IMM){
+        if(out->const_count > 0xFF){
+          free_bytecode(out);
+          return ERR_OPERAND_OUT_OF_RANGE;
+        }
+        reg = out->const_count;
+        out->consts[out->const_count++] = op1->value.imm;
+      }
+    }
+    if(program[i].steps > 0xFF){
+      free_bytecode(out);
+      return ERR_OPERAND_OUT_OF_RANGE;
+    }
+    out->code[i] = BC_MAKE(program[i].ID, op1->type, op2->type, reg, imm) | ((Bytecode)program[i].steps << 24);
+  }
+  out->size = program_size;
+  return ERR_OK;
+}
+
+void free_bytecode(BytecodeProgram* bc){
+  if(!bc) return;
+  free(bc->code);
+  free(bc->consts);
+  bc->code = NULL;
+  bc->consts = NULL;
+  bc->size = 0;
+  bc->const_count = 0;
+}
+
+static void free_lines(char** lines, char*** tokens, int linecount){
+  for(int i = 0; i < linecount; i++) {
+    if(lines) free(lines[i]);
+    if(tokens && tokens[i]) free_tokens(tokens[i]);
+  }
+  free(lines);
+  free(tokens);
+}
+
+bool assemble_buffer(const char* src, size_t len, AsmResult* out){
+    memset(out, 0, sizeof(AsmResult));
     int a_program_size = 0;
     Instr *a_program = NULL;
 
     // Phase 1: Lexical Analysis
-    FILE* code = fopen("fuzz_input.txt", "r");
-    if(!code) {
-        report_asm_error(ERR_IO, 335, NULL, "Couldn't open code file");
-    }
-    
     int linecount = 0;
-    char **lines = split_lines(code, &linecount);
-    fclose(code);
-    
-    if(!lines) {
-      report_asm_error(ERR_IO, 343, NULL, "Couldn't read the file");
-    }
+    int line_numbers[MAX_LINES];
+    char **lines = split_lines(src, len, &linecount, line_numbers, out);
+    if(!lines) return false;
     
     if(linecount == 0) {
       free(lines);
-      report_asm_error(ERR_IO, 343, NULL, "File is empty");
-       
+      return asm_error(out, ERR_IO, 0, NULL, "File is empty");
     }
     
     // Phase 2: Tokenization
-    char ***tokens = malloc(sizeof(char**) * linecount);
+    char ***tokens = calloc(linecount, sizeof(char**));
     if(!tokens) {
-        for(int i = 0; i < linecount; i++) free(lines[i]);
-        free(lines);
-        report_asm_error(ERR_ALLOC_FAIL, 357, NULL, "Couldn't allocate space for tokens");
+        free_lines(lines, NULL, linecount);
+        return asm_error(out, ERR_ALLOC_FAIL, 0, NULL, "Couldn't allocate space for tokens");
     }
     
     for(int i = 0; i < linecount; i++) {
-        tokens[i] = tokenizer(lines[i]);
+        tokens[i] = tokenizer(lines[i], line_numbers[i], out);
         
         // Critical check: tokenizer returns NULL for invalid lines
         if(!tokens[i] || !tokens[i][0]) {
-            // Cleanup
-            for(int j = 0; j < i; j++) {
-                if(tokens[j]) free_tokens(tokens[j]);
-            }
-            free(tokens);
-            for(int j = 0; j < linecount; j++) free(lines[j]);
-            free(lines);
-            report_asm_error(ERR_INVALID_TOKEN, 375, NULL, "Tokenization failed for line");
+            free_lines(lines, tokens, linecount);
+            return asm_error(out, ERR_INVALID_TOKEN, line_numbers[i], NULL, "Tokenization failed for line");
         }
     }
     
@@ -452,48 +658,74 @@ void define_program(Instr **out_program, int *out_size, Label **out_labels, int
     a_program_size = linecount;
     a_program = malloc(sizeof(Instr) * a_program_size);
     if(!a_program) {
-        // Cleanup
-        for(int i = 0; i < linecount; i++) {
-            free(lines[i]);
-            if(tokens[i]) free_tokens(tokens[i]);
-        }
-        free(lines);
-        free(tokens);
-        report_asm_error(ERR_ALLOC_FAIL, 387, NULL, "Memory alocation for program failed");
+        free_lines(lines, tokens, linecount);
+        return asm_error(out, ERR_ALLOC_FAIL, 0, NULL, "Memory alocation for program failed");
     }
     
     for(int i = 0; i < linecount; i++) {
-        a_program[i] = Encoder(tokens[i]);
-           }
+        if(!Encoder(tokens[i], &a_program[i], line_numbers[i], out)){
+          free_program(a_program, i);
+          free_lines(lines, tokens, linecount);
+          return false;
+        }
+    }
+    free_lines(lines, tokens, linecount);
       state_update_histogram(current_state, a_program_size, a_program);
       state_update_num_features(current_state, a_program_size, a_program); //separate both functions depending on what they fill up #separation_of_church_and_state
     int label_count = 0;
-    Label *lb_array = parse_labels(a_program, a_program_size, &label_count, MAXLABELS);
-    if(!lb_array){
+    Label *lb_array = parse_labels(a_program, a_program_size, &label_count, MAXLABELS, out);
+    if(!lb_array || !link_labels(a_program, a_program_size, lb_array, label_count, out)){
+      if(out->line >= 0 && out->line < a_program_size) out->line = line_numbers[out->line];
+      else out->line = 0;
+      free(lb_array);
       free_program(a_program, a_program_size);
-      for(int i=0; i < linecount; i++){
-        free(lines[i]);
-        if(tokens[i]) free(tokens[i]);
-      }
-      free(lines);
-      free(tokens);
-      report_asm_error(ERR_ALLOC_FAIL, 446, "LABELS", "Label array allocation and/or creation failed");
-
-  }
-    
-    *out_program = a_program;
-    *out_size = a_program_size;
-    *out_label_count = label_count;
-    *out_labels = lb_array;
-    // Phase 4: Cleanup intermediate structures
-    for(int i = 0; i < linecount; i++) {
-        free(lines[i]);
-        if(tokens[i]) free_tokens(tokens[i]);
+      return false;
     }
-    free(lines);
-    free(tokens);
+    
+    out->program = a_program;
+    out->program_size = a_program_size;
+    out->labels = lb_array;
+    out->label_count = label_count;
+    return true;
 }
 
+//file front end for standalone runs, the fuzzers assemble shared_input with assemble_buffer instead.
+//any assembler error is printed and exits
+void define_program(Instr **out_program, int *out_size, Label **out_labels, int *out_label_count) {
+    FILE* code = fopen("fuzz_input.txt", "rb");
+    if(!code) {
+        report_asm_error(ERR_IO, 0, NULL, "Couldn't open code file");
+    }
 
+    size_t cap = 4096, len = 0, n;
+    char *src = malloc(cap);
+    while(src && (n = fread(src + len, 1, cap - len, code)) > 0){
+      len += n;
+      if(len == cap){
+        char *grown = realloc(src, cap * 2);
+        if(!grown){
+          free(src);
+          src = NULL;
+          break;
+        }
+        src = grown;
+        cap *= 2;
+      }
+    }
+    fclose(code);
+    if(!src) {
+      report_asm_error(ERR_ALLOC_FAIL, 0, NULL, "Couldn't read the file");
+    }
 
+    AsmResult res;
+    bool assembled = assemble_buffer(src, len, &res);
+    free(src);
+    if(!assembled){
+      report_asm_error(res.error, res.line, res.has_token ? res.token : NULL, res.detail);
+    }
 
+    *out_program = res.program;
+    *out_size = res.program_size;
+    *out_label_count = res.label_count;
+    *out_labels = res.labels;
+}
@@ -0,0 +1,420 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdbool.h>
+#include<string.h>
+#include<limits.h>
+#include"header.h"
+#include"cfg.h"
+#include"verify.h"
+#include"optimize.h"
+
+typedef struct Optimizer{
+  Instr *in;
+  int n;
+  int passes;
+  bool keep_steps;
+  StackRange *at; //verify_ranges over the input. threading only takes jumps out of runs, so it stays sound
+  int *steps; //per input instruction, threading adds the ones a jump now skips
+  int *inline_ret; //RET closing the body an inlined CALL is replaced with, -1 when not inlined
+  bool *live;
+  bool *entry; //jumped or returned to, folds never reach across one
+  bool *drop;
+  int *map; //input ip -> output ip, a dropped instruction maps to whatever is written after it
+  int *work;
+  Instr *out;
+  int *origin; //input instruction whose range covers out[k]
+  int nout;
+  int fence; //output index of the latest entry
+  int changes;
+} Optimizer;
+
+static bool is_jump(Operations id){
+  return id >= JMP && id <= JLE;
+}
+
+//with compat steps add up, otherwise every instruction stays a single step
+static inline int merged(const Optimizer* o, int a, int b){
+  return o->keep_steps ? a + b : a;
+}
+
+//with compat a rewrite whose merged count wouldn't fit BC_STEPS is skipped
+static inline bool fits(const Optimizer* o, int steps){
+  return !o->keep_steps || steps <= OPT_STEPS_MAX;
+}
+
+static bool valid_regs(const Instr* in){
+  const Operand *ops[2] = {&in->operand1, &in->operand2};
+  for(int k=0; k<2; k++){
+    if(ops[k]->type == REG && (ops[k]->value.reg < 0 || ops[k]->value.reg >= NUMOFREGS)) return false;
+  }
+  return true;
+}
+
+//MAXSTEPS and the loop check aside
+static bool never_faults(const Instr* in, const StackRange* s){
+  switch(in->ID){
+    case PSH: case LOAD: case ADD: case SUB: case MUL: case POP: case CALL: case RET:
+      return s->reachable && verify_proven(in->ID, in, s);
+    case DIV:
+      return false;
+    default:
+      return valid_regs(in);
+  }
+}
+
+static void free_label(Instr* in){
+  if(in->operand1.type == LABEL && in->operand1.value.label) free((void*)in->operand1.value.label);
+  if(in->operand2.type == LABEL && in->operand2.value.label) free((void*)in->operand2.value.label);
+}
+
+//THREADING
+
+//first instruction from t on that isn't a LBL, *skipped gets their steps
+static int skip_labels(const Optimizer* o, int t, int* skipped){
+  while(t < o->n && o->in[t].ID == LBL){
+    *skipped += o->steps[t];
+    t++;
+  }
+  return t;
+}
+
+//JMP and CALL always reach their target, so the steps they skip can go on them. a Jcc is only followed through
+//a JMP or a Jcc on the same condition, nothing between the two touches the flags
+static void thread_jumps(Optimizer* o){
+  for(int i=0; i<o->n; i++){
+    Instr *in = &o->in[i];
+    Operations id = in->ID;
+    if(!is_jump(id) && id != CALL) continue;
+    bool always = (id == JMP || id == CALL);
+    if(o->keep_steps && (!always || !never_faults(in, &o->at[i]))) continue;
+
+    int target = in->operand1.target;
+    int skipped = 0;
+    for(int hops=0; hops<o->n; hops++){
+      int extra = 0;
+      int u = skip_labels(o, target, &extra);
+      if(u >= o->n) break;
+      const Instr *next = &o->in[u];
+      if(!fits(o, o->steps[i] + skipped + extra + o->steps[u])) break;
+      if(id == JMP && next->ID == HLT){
+        free_label(in);
+        in->ID = HLT;
+        in->execute = next->execute;
+        in->operand1 = next->operand1;
+        in->operand2 = next->operand2;
+        o->steps[i] = merged(o, o->steps[i], skipped + extra + o->steps[u]);
+        o->changes++;
+        break;
+      }
+      bool follows = next->ID == JMP || (next->ID == id && !always);
+      //a jump onto itself loops forever either way, longer cycles run out of hops
+      if(!follows || next->operand1.target == target) break;
+      target = next->operand1.target;
+      skipped += extra + o->steps[u];
+    }
+    if(in->ID == id && target != in->operand1.target){
+      in->operand1.target = target;
+      o->steps[i] = merged(o, o->steps[i], skipped);
+      o->changes++;
+    }
+  }
+}
+
+//INLINING
+
+//what the CALL, the body and the RET add up to, all of it goes on the copies
+static int inline_steps(const Optimizer* o, int call, int ret){
+  int steps = o->steps[call];
+  for(int k=o->in[call].operand1.target; k<=ret; k++) steps += o->steps[k];
+  return steps;
+}
+
+//RET closing the body the CALL can be replaced with, -1 if it can't. dropping a CALL that may overflow
+//would lose its fault, and with compat the copies take the CALL's steps so none of them may fault either
+static int inline_ret(const Optimizer* o, int call){
+  const Instr *in = &o->in[call];
+  if(!never_faults(in, &o->at[call])) return -1;
+  int count = 0;
+  for(int k=in->operand1.target; k>=0 && k<o->n; k++){
+    const Instr *body = &o->in[k];
+    if(body->ID == LBL) continue;
+    if(body->ID == RET) return (count > 0 && fits(o, inline_steps(o, call, k))) ? k : -1;
+    if(body->ID == CALL || body->ID == HLT || is_jump(body->ID) || ++count > OPT_INLINE_MAX) return -1;
+    if(o->keep_steps && !never_faults(body, &o->at[k])) return -1;
+  }
+  return -1;
+}
+
+//LIVENESS
+
+//reachable from ip 0 over the threaded jumps, and by verify_ranges (an instruction after one that always faults isn't)
+static void mark_live(Optimizer* o){
+  if(!(o->passes & OPT_DCE)){
+    for(int i=0; i<o->n; i++) o->live[i] = true;
+    return;
+  }
+  int top = 0;
+#define REACH(k) do{ \
+    int r = (k); \
+    if(r >= 0 && r < o->n && !o->live[r] && o->at[r].reachable){ o->live[r] = true; o->work[top++] = r; } \
+  } while(0)
+
+  REACH(0);
+  while(top > 0){
+    int i = o->work[--top];
+    Operations id = o->in[i].ID;
+    int target = o->in[i].operand1.target;
+    switch(id){
+      case HLT: case RET:
+        break;
+      case JMP:
+        REACH(target);
+        break;
+      case CALL:
+        if(o->inline_ret[i] < 0) REACH(target);
+        REACH(i + 1);
+        break;
+      default:
+        if(is_jump(id)) REACH(target);
+        REACH(i + 1);
+        break;
+    }
+  }
+#undef REACH
+}
+
+static void mark_entries(Optimizer* o){
+  o->entry[0] = true;
+  for(int i=0; i<o->n; i++){
+    if(!o->live[i]) continue;
+    Operations id = o->in[i].ID;
+    bool called = (id == CALL && o->inline_ret[i] < 0);
+    int target = o->in[i].operand1.target;
+    if((is_jump(id) || called) && target >= 0 && target < o->n) o->entry[target] = true;
+    if(called && i + 1 < o->n) o->entry[i + 1] = true;
+  }
+}
+
+//with compat a dropped LBL's step goes on the next instruction, which then must not be entered any other way or fault
+static bool label_droppable(const Optimizer* o, int i){
+  if(!o->keep_steps) return true;
+  int k = i + 1;
+  return k < o->n && o->live[k] && !o->entry[k] && never_faults(&o->in[k], &o->at[k]);
+}
+
+//every instruction between a forward jump and its target is dropped, it lands where it would fall through
+static bool lands_next(const Optimizer* o, int i){
+  int target = o->in[i].operand1.target;
+  if(target <= i) return false;
+  for(int k=i + 1; k<target; k++){
+    if(!o->drop[k]) return false;
+  }
+  return true;
+}
+
+//back to front so lands_next sees the drops after it
+static void mark_drops(Optimizer* o){
+  for(int i=o->n - 1; i>=0; i--){
+    Operations id = o->in[i].ID;
+    if(!o->live[i]) o->drop[i] = true;
+    else if(id == LBL && (o->passes & OPT_LABELS)) o->drop[i] = label_droppable(o, i);
+    else if(is_jump(id) && (o->passes & OPT_THREAD) && !o->keep_steps) o->drop[i] = lands_next(o, i);
+    if(o->drop[i]) o->changes++;
+  }
+}
+
+//FOLDING
+
+//a op b the way the handlers compute it, false where the handler faults or traps instead
+static bool fold_value(Operations op, int a, int b, int* out){
+  switch(op){
+    case ADD: *out = (int)((unsigned)a + (unsigned)b); return true;
+    case SUB: *out = (int)((unsigned)a - (unsigned)b); return true;
+    case MUL: *out = (int)((unsigned)a * (unsigned)b); return true;
+    case DIV:
+      if(b == 0 || (a == INT_MIN && b == -1)) return false;
+      *out = a / b;
+      return true;
+    default:
+      return false;
+  }
+}
+
+//folds the instruction just written into the ones before it, never below the latest entry. the pushes have to be
+//proven not to overflow where they were, otherwise the folded program could get past a fault the source stops at
+static void fold_tail(Optimizer* o){
+  int k = o->nout - 1;
+  Instr *op = &o->out[k];
+  if(op->ID == POP){
+    if(o->keep_steps || k - 1 < o->fence) return;
+    const Instr *prev = &o->out[k - 1];
+    if((prev->ID == PSH || prev->ID == LOAD) && never_faults(prev, &o->at[o->origin[k - 1]])){
+      o->nout -= 2;
+      o->changes++;
+    }
+    return;
+  }
+  if(op->ID < ADD || op->ID > DIV || k - 2 < o->fence) return;
+  Instr *a = &o->out[k - 2];
+  const Instr *b = &o->out[k - 1];
+  if(a->ID != PSH || b->ID != PSH || a->operand1.type != IMM || b->operand1.type != IMM) return;
+  if(!never_faults(a, &o->at[o->origin[k - 2]]) || !never_faults(b, &o->at[o->origin[k - 1]])) return;
+  int value;
+  if(!fits(o, a->steps + b->steps + op->steps)) return;
+  if(!fold_value(op->ID, a->operand1.value.imm, b->operand1.value.imm, &value)) return;
+  a->operand1.value.imm = value;
+  a->steps = merged(o, a->steps, b->steps + op->steps);
+  o->nout -= 2;
+  o->changes++;
+}
+
+static void emit(Optimizer* o, const Instr* in, int steps, int origin){
+  o->out[o->nout] = *in;
+  o->out[o->nout].steps = steps;
+  o->origin[o->nout] = origin;
+  o->nout++;
+  if(o->passes & OPT_FOLD) fold_tail(o);
+}
+
+//pending steps that don't fit on the next instruction stay on the latest dropped LBL, which is written after all.
+//only drops came since it, so everything mapped from it on already points here. in a run of dropped LBLs only the
+//first can be an entry (label_droppable), so no jump lands past steps it shouldn't take
+static void spill_pending(Optimizer* o, int* pending, int label){
+  o->drop[label] = false;
+  o->changes--;
+  emit(o, &o->in[label], *pending, label);
+  *pending = 0;
+}
+
+static void emit_program(Optimizer* o){
+  int pending = 0; //steps of dropped LBLs, they go on the next instruction written
+  int pending_label = -1;
+  for(int i=0; i<o->n; i++){
+    int ret = o->inline_ret[i];
+    if(o->live[i] && pending > 0){
+      int receives = (ret < 0) ? o->steps[i] : inline_steps(o, i, ret);
+      if(!fits(o, pending + receives)) spill_pending(o, &pending, pending_label);
+    }
+    o->map[i] = o->nout;
+    if(o->entry[i]) o->fence = o->nout;
+    if(o->drop[i]){
+      if(o->live[i]){
+        pending = merged(o, pending, o->steps[i]);
+        pending_label = i;
+      }
+      continue;
+    }
+    if(ret < 0){
+      emit(o, &o->in[i], merged(o, o->steps[i], pending), i);
+      pending = 0;
+      continue;
+    }
+    //the CALL's and the body LBLs' steps go on the copies after them, the RET's on the last one. they are all on it
+    //before it's written, so a fold into it sees the whole count
+    int last = ret - 1;
+    while(o->in[last].ID == LBL) last--;
+    int carry = merged(o, pending, o->steps[i]);
+    for(int k=o->in[i].operand1.target; k<=last; k++){
+      if(o->in[k].ID == LBL){
+        carry = merged(o, carry, o->steps[k]);
+        continue;
+      }
+      if(k == last){
+        for(int t=k + 1; t<=ret; t++) carry = merged(o, carry, o->steps[t]);
+      }
+      emit(o, &o->in[k], merged(o, o->steps[k], carry), k);
+      carry = 0;
+    }
+    pending = 0;
+    o->changes++;
+  }
+}
+
+static void optimizer_free(Optimizer* o){
+  free(o->at);
+  free(o->steps);
+  free(o->inline_ret);
+  free(o->live);
+  free(o->entry);
+  free(o->drop);
+  free(o->map);
+  free(o->work);
+  free(o->out);
+  free(o->origin);
+}
+
+int optimize_program(Instr** program, int* program_size, Label* labels, int label_count, int passes){
+  Optimizer o;
+  memset(&o, 0, sizeof(Optimizer));
+  o.in = *program;
+  o.n = *program_size;
+  o.passes = passes;
+  o.keep_steps = (passes & OPT_KEEP_STEPS) != 0;
+  if(!o.in || o.n < 1) return 0;
+
+  //every input instruction writes at most one instruction, or an inlined body
+  int cap = o.n * (OPT_INLINE_MAX > 1 ? OPT_INLINE_MAX : 1);
+  o.at = malloc(sizeof(StackRange) * o.n);
+  o.steps = malloc(sizeof(int) * o.n);
+  o.inline_ret = malloc(sizeof(int) * o.n);
+  o.live = calloc(o.n, sizeof(bool));
+  o.entry = calloc(o.n, sizeof(bool));
+  o.drop = calloc(o.n, sizeof(bool));
+  o.map = malloc(sizeof(int) * o.n);
+  o.work = malloc(sizeof(int) * o.n);
+  o.out = malloc(sizeof(Instr) * cap);
+  o.origin = malloc(sizeof(int) * cap);
+  CFG cfg;
+  bool ok = o.at && o.steps && o.inline_ret && o.live && o.entry && o.drop && o.map && o.work && o.out && o.origin;
+  if(ok && cfg_build(o.in, o.n, &cfg)){
+    ok = verify_ranges(o.in, &cfg, o.at);
+    cfg_free(&cfg);
+  } else {
+    ok = false;
+  }
+  if(!ok){
+    optimizer_free(&o);
+    return -1;
+  }
+
+  for(int i=0; i<o.n; i++){
+    o.steps[i] = o.in[i].steps;
+    o.inline_ret[i] = -1;
+  }
+  if(passes & OPT_THREAD) thread_jumps(&o);
+  int threaded = o.changes; //done in place, the rest only counts once the output replaces the input
+  if(passes & OPT_INLINE){
+    for(int i=0; i<o.n; i++){
+      if(o.in[i].ID == CALL && o.at[i].reachable) o.inline_ret[i] = inline_ret(&o, i);
+    }
+  }
+  mark_live(&o);
+  mark_entries(&o);
+  mark_drops(&o);
+  emit_program(&o);
+
+  //a program that only runs off its end keeps its instructions, vm_fetch faults on it either way
+  if(o.nout == 0){
+    optimizer_free(&o);
+    return threaded;
+  }
+
+  for(int k=0; k<o.nout; k++){
+    Operand *op = &o.out[k].operand1;
+    if(op->type == LABEL && op->target >= 0 && op->target < o.n) op->target = o.map[op->target];
+  }
+  for(int j=0; j<label_count; j++){
+    if(labels[j].address >= 0 && labels[j].address < o.n) labels[j].address = o.map[labels[j].address];
+  }
+  for(int i=0; i<o.n; i++){
+    if(o.drop[i] || o.inline_ret[i] >= 0) free_label(&o.in[i]);
+  }
+  free(o.in);
+
+  *program = o.out;
+  *program_size = o.nout;
+  o.out = NULL;
+  int changes = o.changes;
+  optimizer_free(&o);
+  return changes;
+}
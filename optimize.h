@@ -0,0 +1,30 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+#include"header.h"
+
+//optional passes over a linked program, run after assembly and before fuse_program/verify_program. the program
+//is rebuilt compacted, so ips (and ip-keyed coverage) follow the optimized layout. no pass changes which
+//stack/callstack fault a run ends in: merging or dropping an instruction that could fault has to be proven
+//safe against verify_ranges first
+
+#define OPT_FOLD   (1 << 0) //psh a; psh b; add|sub|mul|div -> psh (a op b), psh|load; pop -> nothing
+#define OPT_DCE    (1 << 1) //drop instructions no run can reach
+#define OPT_LABELS (1 << 2) //drop LBLs, jumps land on the instruction after them
+#define OPT_THREAD (1 << 3) //jumps to jumps go to the final target, jmp to hlt becomes hlt, jumps to the next instruction go away
+#define OPT_INLINE (1 << 4) //call f -> f's body when it is at most OPT_INLINE_MAX straight-line instructions before a ret
+#define OPT_ALL    (OPT_FOLD | OPT_DCE | OPT_LABELS | OPT_THREAD | OPT_INLINE)
+//compat: merged instructions carry the steps of what they replaced (Instr.steps), so stepcount and MAXSTEPS come
+//out as for the unoptimized program. steps only move onto instructions that can't fault, and rewrites whose count
+//would depend on the path taken (conditional threading, jumps to the next instruction, psh; pop) are skipped.
+//LOOP_CHECK stops at whichever back edge sees the repeat, its counts aren't kept. a merge that would go over
+//OPT_STEPS_MAX isn't made, bytecode has 8 bits for it
+#define OPT_KEEP_STEPS (1 << 5)
+#define OPT_STEPS_MAX 0xFF
+
+#define OPT_INLINE_MAX 4
+
+//replaces *program/*program_size (the old array is released) and moves labels[].address along with it.
+//returns how many rewrites were made, -1 when out of memory with the program left as it was
+int optimize_program(Instr** program, int* program_size, Label* labels, int label_count, int passes);
+
+#endif
@@ -0,0 +1,275 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdbool.h>
+#include<string.h>
+#include"header.h"
+#include"error.h"
+#include"reg_vm.h"
+#include"coverage.h"
+
+//TRANSLATION
+
+static inline RegOperand rop(RegKind kind, int v){
+  RegOperand o = {kind, v};
+  return o;
+}
+
+static inline int min_int(int a, int b){ return a < b ? a : b; }
+static inline int max_int(int a, int b){ return a > b ? a : b; }
+
+typedef struct Translator{
+  RegProgram *rp;
+  RegOperand *sym; //what each slot holds, indexed by offset from the entry sp, can go negative
+  int depth;
+  int low; //lowest depth reached, slots at or below it are untouched memory
+  int high;
+  int steps; //Instr.steps of the block's instructions before the current one
+} Translator;
+
+static void emit(Translator* t, RegOp op, RegOperand dst, RegOperand a, RegOperand b, int ip){
+  RegInstr *ri = &t->rp->code[t->rp->ncode++];
+  ri->op = op;
+  ri->dst = dst;
+  ri->a = a;
+  ri->b = b;
+  ri->ip = ip;
+  ri->depth = t->depth;
+  ri->steps = t->steps;
+}
+
+static RegOperand take(Translator* t, int d){
+  return t->sym[d];
+}
+
+static void materialize(Translator* t, int d, int ip){
+  if(t->sym[d].kind == RK_SLOT) return;
+  emit(t, RI_MOV, rop(RK_SLOT, d), t->sym[d], rop(RK_IMM, 0), ip);
+  t->sym[d] = rop(RK_SLOT, d);
+}
+
+//a pending LOAD must see the register value from before the write
+static void materialize_reg(Translator* t, int reg, int ip){
+  for(int d=t->low + 1; d<=t->depth; d++){
+    if(t->sym[d].kind == RK_REG && t->sym[d].v == reg) materialize(t, d, ip);
+  }
+}
+
+static void translate_block(Translator* t, const Instr* program, const CFGBlock* cb, RegBlock* blk){
+  RegProgram *rp = t->rp;
+  int i = cb->start;
+
+  t->depth = 0;
+  t->low = 0;
+  t->high = 0;
+  t->steps = 0;
+  blk->start = cb->start;
+  blk->first = rp->ncode;
+  blk->term = cb->term;
+  blk->min_base = -1;
+  blk->max_base = STACKSIZE - 1;
+
+  int body_end = (cb->term >= 0) ? cb->term : cb->end;
+  for(; i<body_end; i++){
+    const Instr *in = &program[i];
+    Operations id = cfg_source_id(in);
+
+    switch(id){
+      case PSH:
+      case LOAD:
+        //instr_psh/instr_load fault when sp >= STACKSIZE-1 before the push
+        blk->max_base = min_int(blk->max_base, STACKSIZE - 2 - t->depth);
+        t->depth++;
+        t->high = max_int(t->high, t->depth);
+        t->sym[t->depth] = (id == PSH) ? rop(RK_IMM, in->operand1.value.imm) : rop(RK_REG, in->operand1.value.reg);
+        break;
+      case POP:
+        blk->min_base = max_int(blk->min_base, 0 - t->depth);
+        t->depth--;
+        t->low = min_int(t->low, t->depth);
+        break;
+      case ADD: case SUB: case MUL: case DIV: {
+        blk->min_base = max_int(blk->min_base, 1 - t->depth);
+        RegOperand b = take(t, t->depth);
+        RegOperand a = take(t, t->depth - 1);
+        if(id == DIV){
+          //a zero divisor is replayed through instr_div, everything under the operands has to be in memory by then
+          for(int d=t->low + 1; d<=t->depth - 2; d++) materialize(t, d, i);
+        }
+        RegOp op = (id == ADD) ? RI_ADD : (id == SUB) ? RI_SUB : (id == MUL) ? RI_MUL : RI_DIV;
+        emit(t, op, rop(RK_SLOT, t->depth - 1), a, b, i);
+        t->depth--;
+        t->low = min_int(t->low, t->depth - 1);
+        t->sym[t->depth] = rop(RK_SLOT, t->depth);
+        break;
+      }
+      case SET:
+        materialize_reg(t, in->operand1.value.reg, i);
+        emit(t, RI_SET, rop(RK_REG, in->operand1.value.reg), rop(RK_IMM, in->operand2.value.imm), rop(RK_IMM, 0), i);
+        break;
+      case INC:
+      case DEC:
+        materialize_reg(t, in->operand1.value.reg, i);
+        emit(t, id == INC ? RI_INC : RI_DEC, rop(RK_REG, in->operand1.value.reg), rop(RK_IMM, 0), rop(RK_IMM, 0), i);
+        break;
+      case CMP: {
+        RegOperand a = (in->operand1.type == REG) ? rop(RK_REG, in->operand1.value.reg) : rop(RK_IMM, in->operand1.value.imm);
+        RegOperand b = (in->operand2.type == REG) ? rop(RK_REG, in->operand2.value.reg) : rop(RK_IMM, in->operand2.value.imm);
+        emit(t, RI_CMP, rop(RK_IMM, 0), a, b, i);
+        break;
+      }
+      case LBL:
+      default:
+        break;
+    }
+    t->steps += in->steps;
+  }
+
+  for(int d=t->low + 1; d<=t->depth; d++) materialize(t, d, i);
+
+  blk->body_count = body_end - blk->start;
+  blk->body_steps = t->steps;
+  blk->nops = rp->ncode - blk->first;
+  blk->depth = t->depth;
+  //only the touched range is reset, keeps translation linear
+  for(int d=t->low - 1; d<=t->high; d++) t->sym[d] = rop(RK_SLOT, d);
+}
+
+bool reg_translate(const Instr* program, int program_size, RegProgram* out){
+  memset(out, 0, sizeof(RegProgram));
+  if(!cfg_build(program, program_size, &out->cfg)) return false;
+
+  Translator t;
+  t.rp = out;
+  //a block can pop at most program_size slots below its entry and push as many above it, the reset after it
+  //reaches two more below (low - 1 after a binary op)
+  RegOperand *sym_storage = malloc(sizeof(RegOperand) * (2 * program_size + 5));
+  t.sym = sym_storage + program_size + 2;
+  //every source instruction emits at most one op, and every pending push is materialized at most once
+  out->code = malloc(sizeof(RegInstr) * (2 * program_size + 1));
+  out->blocks = malloc(sizeof(RegBlock) * out->cfg.nblocks);
+  if(!sym_storage || !out->code || !out->blocks){
+    free(sym_storage);
+    reg_free(out);
+    return false;
+  }
+  for(int d=-program_size - 2; d<=program_size + 2; d++) t.sym[d] = rop(RK_SLOT, d);
+
+  //jumps land on CFG leaders and returns right after a CALL, so block starts are all the entry points
+  for(int b=0; b<out->cfg.nblocks; b++){
+    translate_block(&t, program, &out->cfg.blocks[b], &out->blocks[b]);
+  }
+  out->nblocks = out->cfg.nblocks;
+  free(sym_storage);
+  return true;
+}
+
+void reg_free(RegProgram* rp){
+  if(!rp) return;
+  free(rp->code);
+  free(rp->blocks);
+  cfg_free(&rp->cfg);
+  memset(rp, 0, sizeof(RegProgram));
+}
+
+//EXECUTION
+
+static inline int rop_read(const VM* vm, int base, RegOperand o){
+  switch(o.kind){
+    case RK_IMM: return o.v;
+    case RK_REG: return vm->registers[o.v];
+    default: return vm->stack[base + o.v];
+  }
+}
+
+static void run_block(VM* vm, const RegProgram* rp, const RegBlock* blk, int base){
+  const RegInstr *op = &rp->code[blk->first];
+  const RegInstr *end = op + blk->nops;
+  int entry_steps = vm->stepcount;
+
+  for(; op<end; op++){
+    switch(op->op){
+      case RI_MOV:
+        vm->stack[base + op->dst.v] = rop_read(vm, base, op->a);
+        break;
+      case RI_ADD:
+        vm->stack[base + op->dst.v] = rop_read(vm, base, op->b) + rop_read(vm, base, op->a);
+        break;
+      case RI_SUB:
+        vm->stack[base + op->dst.v] = rop_read(vm, base, op->a) - rop_read(vm, base, op->b);
+        break;
+      case RI_MUL:
+        vm->stack[base + op->dst.v] = rop_read(vm, base, op->b) * rop_read(vm, base, op->a);
+        break;
+      case RI_DIV: {
+        int divisor = rop_read(vm, base, op->b);
+        int dividend = rop_read(vm, base, op->a);
+        if(divisor == 0){
+          //put the VM where the stack engine would be and let the handler raise the error
+          vm->stack[base + op->depth - 1] = dividend;
+          vm->stack[base + op->depth] = divisor;
+          vm->sp = base + op->depth;
+          vm->ip = op->ip + 1;
+          vm->stepcount = entry_steps + op->steps;
+          instr_div(vm, &vm->program[op->ip]);
+          return;
+        }
+        vm->stack[base + op->dst.v] = dividend / divisor;
+        break;
+      }
+      case RI_SET:
+        vm->registers[op->dst.v] = op->a.v;
+        break;
+      case RI_INC:
+        vm->registers[op->dst.v]++;
+        break;
+      case RI_DEC:
+        vm->registers[op->dst.v]--;
+        break;
+      case RI_CMP:
+        flags_from_cmp(&vm->flags, rop_read(vm, base, op->a), rop_read(vm, base, op->b));
+        break;
+    }
+  }
+
+  vm->sp = base + blk->depth;
+  vm->stepcount = entry_steps + blk->body_steps;
+  vm->ip = blk->start + blk->body_count;
+  if(blk->term >= 0){
+    const Instr *term = &vm->program[blk->term];
+    vm->ip++;
+    term->execute(vm, term);
+    if(vm->error != ERR_OK) return;
+    vm->stepcount += term->steps;
+  }
+}
+
+//an edge between two blocks, same direct/hashed and call context rules as the per-instruction VM edges
+static inline void cov_record_block(VM* vm, const RegProgram* rp, int b){
+  VMCoverage *cov = vm->cov;
+  uint32_t ctx = vm->call_ctx & cov->ctx_mask;
+  uint32_t edge = (cov->direct && rp->nblocks <= DIRECT_EDGE_STRIDE)
+    ? edge_map_next_direct(cov->vm_map, (uint32_t)b, ctx)
+    : edge_map_next(cov->vm_map, (uint32_t)b ^ ctx);
+  edge_map_hit(cov->vm_map, edge);
+}
+
+void vm_run_regs(VM* vm, VMTraceFunc trace){
+  const RegProgram *rp = vm->regprog;
+
+  while(vm->running){
+    int b = cfg_block_at(&rp->cfg, vm->ip);
+    //recorded whichever way the block then runs, so fallbacks to vm_step don't change the edges
+    if(b >= 0 && vm->cov) cov_record_block(vm, rp, b);
+    if(!trace && b >= 0){
+      const RegBlock *blk = &rp->blocks[b];
+      int base = vm->sp;
+      int steps = blk->body_steps + (blk->term >= 0 ? vm->program[blk->term].steps : 0);
+      //outside the guard something in the block faults or hits MAXSTEPS, the handlers report that exactly
+      if(base >= blk->min_base && base <= blk->max_base && vm->stepcount + steps < MAXSTEPS){
+        run_block(vm, rp, blk, base);
+        continue;
+      }
+    }
+    vm_step(vm, trace);
+  }
+}
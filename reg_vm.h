@@ -0,0 +1,55 @@
+#ifndef REG_VM_H
+#define REG_VM_H
+#include"header.h"
+#include"cfg.h"
+
+//register-based IR: each CFG block is translated once, stack slots the block can see statically become
+//operands relative to the sp the block was entered with, registers A-E are used in place
+
+typedef enum {RK_IMM, RK_REG, RK_SLOT} RegKind;
+
+typedef struct RegOperand{
+  RegKind kind;
+  int v; //immediate, register index, or slot offset from the entry sp
+} RegOperand;
+
+typedef enum {RI_MOV, RI_ADD, RI_SUB, RI_MUL, RI_DIV, RI_SET, RI_INC, RI_DEC, RI_CMP} RegOp;
+
+typedef struct RegInstr{
+  RegOp op;
+  RegOperand dst;
+  RegOperand a;
+  RegOperand b;
+  int ip; //source instruction, used when a fault has to be replayed through the stack handler
+  int depth; //stack depth relative to entry before the source instruction ran (DIV only)
+  int steps; //steps the block took before the source instruction (DIV only)
+} RegInstr;
+
+typedef struct RegBlock{
+  int start; //first source instruction
+  int body_count; //source instructions covered by the IR body, LBLs included
+  int body_steps; //what they add to stepcount
+  int term; //the CFG block's terminator, run through its handler
+  int first; //index of the body in RegProgram.code
+  int nops;
+  int depth; //net stack effect
+  int min_base; //entry sp range for which no push/pop in the body can fault
+  int max_base;
+} RegBlock;
+
+typedef struct RegProgram{
+  RegInstr *code;
+  int ncode;
+  RegBlock *blocks; //indexed like cfg.blocks
+  int nblocks;
+  CFG cfg;
+} RegProgram;
+
+bool reg_translate(const Instr* program, int program_size, RegProgram* out);
+void reg_free(RegProgram* rp);
+
+//falls back to single stepping through the handlers whenever a block's entry guard fails or a trace is attached.
+//MAXSTEPS is checked once per block, and with vm->cov set VM edges are recorded between blocks instead of instructions
+void vm_run_regs(VM* vm, VMTraceFunc trace);
+
+#endif
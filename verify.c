@@ -0,0 +1,189 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdbool.h>
+#include<string.h>
+#include"header.h"
+#include"verify.h"
+
+//a block entered more often than this stops growing step by step and jumps to the domain bounds
+#define WIDEN_AFTER 8
+
+static inline int min_int(int a, int b){ return a < b ? a : b; }
+static inline int max_int(int a, int b){ return a > b ? a : b; }
+
+static bool join(StackRange* into, const StackRange* s, bool widen){
+  if(!s->reachable) return false;
+  if(!into->reachable){
+    *into = *s;
+    return true;
+  }
+  StackRange old = *into;
+  if(s->sp_lo < into->sp_lo) into->sp_lo = widen ? -1 : s->sp_lo;
+  if(s->sp_hi > into->sp_hi) into->sp_hi = widen ? STACKSIZE - 1 : s->sp_hi;
+  if(s->csp_lo < into->csp_lo) into->csp_lo = widen ? -1 : s->csp_lo;
+  if(s->csp_hi > into->csp_hi) into->csp_hi = widen ? CALLSIZE - 1 : s->csp_hi;
+  return memcmp(&old, into, sizeof(StackRange)) != 0;
+}
+
+static bool valid_reg(const Instr* instr){
+  return instr->operand1.type == REG && instr->operand1.value.reg >= 0 && instr->operand1.value.reg < NUMOFREGS;
+}
+
+bool verify_proven(Operations id, const Instr* instr, const StackRange* s){
+  switch(id){
+    case PSH: return s->sp_hi < STACKSIZE - 1;
+    case LOAD: return s->sp_hi < STACKSIZE - 1 && valid_reg(instr);
+    case ADD: case SUB: case MUL: case DIV: return s->sp_lo >= 1;
+    case POP: return s->sp_lo >= 0;
+    case CALL: return s->csp_hi < CALLSIZE - 1;
+    case RET: return s->csp_lo >= 0;
+    default: return false;
+  }
+}
+
+//the state after instr for the runs where it didn't fault, unreachable if it always faults
+static StackRange step(Operations id, StackRange s){
+  switch(id){
+    case PSH: case LOAD:
+      s.sp_hi = min_int(s.sp_hi, STACKSIZE - 2) + 1;
+      s.sp_lo++;
+      break;
+    case ADD: case SUB: case MUL: case DIV:
+      s.sp_lo = max_int(s.sp_lo, 1) - 1;
+      s.sp_hi--;
+      break;
+    case POP:
+      s.sp_lo = max_int(s.sp_lo, 0) - 1;
+      s.sp_hi--;
+      break;
+    case CALL:
+      s.csp_hi = min_int(s.csp_hi, CALLSIZE - 2) + 1;
+      s.csp_lo++;
+      break;
+    case RET:
+      s.csp_lo = max_int(s.csp_lo, 0) - 1;
+      s.csp_hi--;
+      break;
+    default:
+      break;
+  }
+  if(s.sp_lo > s.sp_hi || s.csp_lo > s.csp_hi) s.reachable = false;
+  return s;
+}
+
+bool verify_ranges(const Instr* program, const CFG* cfg, StackRange* at){
+  int n = cfg->nblocks;
+  StackRange *entry = calloc(n, sizeof(StackRange));
+  int *visits = calloc(n, sizeof(int));
+  int *work = malloc(sizeof(int) * n);
+  bool *queued = calloc(n, sizeof(bool));
+  //RET can go back to any return site, so they all share one state: the join over every reachable RET
+  int *return_sites = malloc(sizeof(int) * n);
+  if(!entry || !visits || !work || !queued || !return_sites){
+    free(entry); free(visits); free(work); free(queued); free(return_sites);
+    return false;
+  }
+
+  int nreturn = 0;
+  for(int b=0; b<n; b++){
+    const CFGBlock *blk = &cfg->blocks[b];
+    if(blk->term >= 0 && cfg_source_id(&program[blk->term]) == CALL && blk->end < cfg->program_size){
+      return_sites[nreturn++] = b + 1;
+    }
+  }
+
+  int top = 0;
+#define PUSH_BLOCK(b) do{ if(!queued[b]){ queued[b] = true; work[top++] = (b); } } while(0)
+#define FLOW(b, s) do{ \
+    int fb = (b); \
+    if(join(&entry[fb], (s), ++visits[fb] > WIDEN_AFTER)) PUSH_BLOCK(fb); \
+  } while(0)
+
+  StackRange start = {true, -1, -1, -1, -1};
+  FLOW(0, &start);
+
+  while(top > 0){
+    int b = work[--top];
+    queued[b] = false;
+    const CFGBlock *blk = &cfg->blocks[b];
+    StackRange s = entry[b];
+
+    int last = (blk->term >= 0) ? blk->term : blk->end;
+    for(int i=blk->start; i<last && s.reachable; i++){
+      s = step(cfg_source_id(&program[i]), s);
+    }
+    if(!s.reachable) continue;
+
+    if(blk->term < 0){
+      if(blk->end < cfg->program_size) FLOW(b + 1, &s);
+      continue;
+    }
+
+    Operations id = cfg_source_id(&program[blk->term]);
+    StackRange out = step(id, s);
+    if(!out.reachable) continue;
+    int target = program[blk->term].operand1.target;
+    switch(id){
+      case HLT:
+        break;
+      case RET:
+        for(int r=0; r<nreturn; r++) FLOW(return_sites[r], &out);
+        break;
+      case CALL:
+        //the fallthrough is only reached through a RET
+        if(target >= 0 && target < cfg->program_size) FLOW(cfg->block_of[target], &out);
+        break;
+      default:
+        for(int k=0; k<blk->nsucc; k++) FLOW(blk->succ[k], &out);
+        break;
+    }
+  }
+#undef FLOW
+#undef PUSH_BLOCK
+
+  //entry states are final, replay each block once to get the per-instruction ranges
+  for(int b=0; b<n; b++){
+    const CFGBlock *blk = &cfg->blocks[b];
+    StackRange s = entry[b];
+    for(int i=blk->start; i<blk->end; i++){
+      at[i] = s;
+      if(s.reachable) s = step(cfg_source_id(&program[i]), s);
+    }
+  }
+
+  free(entry); free(visits); free(work); free(queued); free(return_sites);
+  return true;
+}
+
+int verify_program(Instr* program, int program_size, int* unproven){
+  CFG cfg;
+  if(!cfg_build(program, program_size, &cfg)) return -1;
+  StackRange *at = malloc(sizeof(StackRange) * program_size);
+  if(!at || !verify_ranges(program, &cfg, at)){
+    free(at);
+    cfg_free(&cfg);
+    return -1;
+  }
+
+  int rewritten = 0, left = 0;
+  for(int i=0; i<program_size; i++){
+    for(int r=0; r<unchecked_table_size; r++){
+      const UncheckedRule *rule = &unchecked_table[r];
+      if(program[i].ID != rule->checked) continue;
+      //unreachable instructions never run, rewriting them is free
+      if(!at[i].reachable || verify_proven(rule->checked, &program[i], &at[i])){
+        program[i].ID = rule->unchecked;
+        program[i].execute = rule->execute;
+        rewritten++;
+      } else {
+        left++;
+      }
+      break;
+    }
+  }
+
+  if(unproven) *unproven = left;
+  free(at);
+  cfg_free(&cfg);
+  return rewritten;
+}
@@ -0,0 +1,27 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+#include"header.h"
+#include"cfg.h"
+
+//abstract interpretation of sp and call_sp over the CFG, starting from vm_init's empty stacks. the ranges only
+//describe runs that haven't faulted yet, a check proven against them can never be the one that stops the VM
+
+typedef struct StackRange{
+  bool reachable;
+  int sp_lo, sp_hi; //sp before the instruction runs
+  int csp_lo, csp_hi; //call_sp before the instruction runs
+} StackRange;
+
+//fills one range per instruction, false if out of memory
+bool verify_ranges(const Instr* program, const CFG* cfg, StackRange* at);
+
+//the stack/callstack check id's handler would run, true when it can't fire for any state in s
+bool verify_proven(Operations id, const Instr* instr, const StackRange* s);
+
+//rewrites every instruction whose bounds check is proven never to fire to its unchecked form (unchecked_table)
+//and returns how many were rewritten, -1 when out of memory. *unproven (may be NULL) gets how many checked
+//instructions are left, 0 means the program runs with no stack/callstack bounds checks at all.
+//run after fuse_program, fused instructions keep their checks
+int verify_program(Instr* program, int program_size, int* unproven);
+
+#endif
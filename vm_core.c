@@ -4,11 +4,10 @@
 #include<string.h>
 #include "header.h"
 #include"error.h"
+#include"coverage.h"
 
 int assess_operand(VM* vm, Operand op){
-  if(!vm){
-    report_vm_error(ERR_IO, vm->ip, NULL, "input processing failed: VM-assessOperand");
-  }
+  if(!vm) return 0;
 
   OperandType type = op.type;
   switch(type){
@@ -16,58 +15,79 @@ int assess_operand(VM* vm, Operand op){
       return op.value.imm;
   case REG:
       if(op.value.reg < 0 || op.value.reg >= NUMOFREGS){
-        report_vm_error(ERR_REGISTER_OUT_OF_BOUNDS, vm->ip, NULL, "Register index used invalid");
+        vm_fault(vm, ERR_REGISTER_OUT_OF_BOUNDS, NULL, "Register index used invalid");
+        return 0;
       }
       return vm->registers[op.value.reg];
   case LABEL:
-      report_vm_error(ERR_INVALID_TOKEN, vm->ip, NULL, "Label operand invalid in this position");
+      vm_fault(vm, ERR_INVALID_TOKEN, NULL, "Label operand invalid in this position");
+      return 0;
   case NONE:
-      report_vm_error(ERR_SYNTAX, vm->ip, NULL, "Operation requires a REG/IMM operand");
+      vm_fault(vm, ERR_SYNTAX, NULL, "Operation requires a REG/IMM operand");
+      return 0;
   default:
-       report_vm_error(ERR_SYNTAX, vm->ip, NULL, "Operation requires a REG/IMM operand");
+       vm_fault(vm, ERR_SYNTAX, NULL, "Operation requires a REG/IMM operand");
+       return 0;
   }
 }
 
 void instr_psh(VM*vm, const Instr* instrc){
   (void)instrc;
   if(vm->sp>=STACKSIZE - 1){
-     report_vm_error(ERR_STACK_OVERFLOW, vm->ip, "PSH", "Stack overflow, can't push further\n");
+     vm_fault(vm, ERR_STACK_OVERFLOW, "PSH", "Stack overflow, can't push further\n");
+     return;
   }
   vm->stack[++vm->sp] = instrc->operand1.value.imm;
 }
 
+//with GUARD_PAGE_STACKS a read below the stack faults into the guard page and vm_run_guarded raises the
+//error. the barrier makes sure everything earlier handlers wrote is in vm by then, not held in registers
+#if GUARD_PAGE_STACKS && defined(__GNUC__)
+#define GUARD_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define GUARD_BARRIER() ((void)0)
+#endif
+
+//both operands are read before sp moves, so an underflow into the guard page
+//leaves the VM exactly where the check would have stopped it
 void instr_add(VM*vm, const Instr* instrc){
   (void)instrc;
-  if(vm->sp<1) report_vm_error(ERR_STACK_UNDERFLOW, vm->ip, "ADD", "Stack doesn't contain enough operands for stack operation");
-  int op1 = vm->stack[vm->sp--];
-  int op2 = vm->stack[vm->sp--];
-  vm->stack[++vm->sp] = op1+op2;
+  if(!GUARD_PAGE_STACKS && vm->sp<1){ vm_fault(vm, ERR_STACK_UNDERFLOW, "ADD", "Stack doesn't contain enough operands for stack operation"); return; }
+  GUARD_BARRIER();
+  int op1 = vm->stack[vm->sp];
+  int op2 = vm->stack[vm->sp - 1];
+  vm->stack[--vm->sp] = op1+op2;
 }
 
 void instr_sub(VM*vm, const Instr* instrc){  
   (void)instrc;
-if(vm->sp<1) report_vm_error(ERR_STACK_UNDERFLOW, vm->ip, "SUB", "Stack doesn't contain enough operands for stack operation");
-  int op1 = vm->stack[vm->sp--];
-  int op2 = vm->stack[vm->sp--];
-  vm->stack[++vm->sp] = op2-op1;
+if(!GUARD_PAGE_STACKS && vm->sp<1){ vm_fault(vm, ERR_STACK_UNDERFLOW, "SUB", "Stack doesn't contain enough operands for stack operation"); return; }
+  GUARD_BARRIER();
+  int op1 = vm->stack[vm->sp];
+  int op2 = vm->stack[vm->sp - 1];
+  vm->stack[--vm->sp] = op2-op1;
 }
 
 void instr_mul(VM*vm, const Instr* instrc){  (void)instrc;
 
- if(vm->sp<1) report_vm_error(ERR_STACK_UNDERFLOW, vm->ip, "MUL", "Stack doesn't contain enough operands for stack operation");
-  int op1 = vm->stack[vm->sp--];
-  int op2 = vm->stack[vm->sp--];
-  vm->stack[++vm->sp] = op1*op2;
+ if(!GUARD_PAGE_STACKS && vm->sp<1){ vm_fault(vm, ERR_STACK_UNDERFLOW, "MUL", "Stack doesn't contain enough operands for stack operation"); return; }
+  GUARD_BARRIER();
+  int op1 = vm->stack[vm->sp];
+  int op2 = vm->stack[vm->sp - 1];
+  vm->stack[--vm->sp] = op1*op2;
 }
 
 void instr_div(VM*vm, const Instr* instrc){  (void)instrc;
 
- if(vm->sp<1) report_vm_error(ERR_STACK_UNDERFLOW, vm->ip, "DIV", "Stack doesn't contain enough operands for stack operation");
-  int op1 = vm->stack[vm->sp--];
-  int op2 = vm->stack[vm->sp--];
+ if(!GUARD_PAGE_STACKS && vm->sp<1){ vm_fault(vm, ERR_STACK_UNDERFLOW, "DIV", "Stack doesn't contain enough operands for stack operation"); return; }
+  GUARD_BARRIER();
+  int op1 = vm->stack[vm->sp];
+  int op2 = vm->stack[vm->sp - 1];
+  vm->sp -= 2;
 
   if(op1 == 0){
-    report_vm_error(ERR_DIVIDE_BY_ZERO, vm->ip, "DIV","Division can't be done by zero\n");
+    vm_fault(vm, ERR_DIVIDE_BY_ZERO, "DIV", "Division can't be done by zero\n");
+    return;
   }
   vm->stack[++vm->sp] = op2/op1;
 }
@@ -75,25 +95,26 @@ void instr_div(VM*vm, const Instr* instrc){  (void)instrc;
 void instr_pop(VM*vm, const Instr* instrc){ (void)instrc;
 
   if(vm->sp<0){
-    report_vm_error(ERR_STACK_UNDERFLOW, vm->ip, "POP","Stack is empty, can't pop\n");
-
+    vm_fault(vm, ERR_STACK_UNDERFLOW, "POP", "Stack is empty, can't pop\n");
+    return;
   }
   vm->sp--;
 }
 
 void instr_set(VM*vm, const Instr* instrc){
   Regs reg = instrc->operand1.value.reg;
-  if(reg < 0 || reg >= NUMOFREGS) report_vm_error(ERR_REGISTER_OUT_OF_BOUNDS, vm->ip, "SET", "Register in input is invalid");
+  if(reg < 0 || reg >= NUMOFREGS){ vm_fault(vm, ERR_REGISTER_OUT_OF_BOUNDS, "SET", "Register in input is invalid"); return; }
   int value = instrc->operand2.value.imm;
   vm->registers[reg] = value;
 }
 
 void instr_load(VM*vm, const Instr* instrc){ 
   if(vm->sp >= STACKSIZE - 1){
-    report_vm_error(ERR_STACK_OVERFLOW, vm->ip, "LOAD", "Can't load anny more elements");
+    vm_fault(vm, ERR_STACK_OVERFLOW, "LOAD", "Can't load anny more elements");
+    return;
   }
   int value = instrc->operand1.value.reg;
-  if(value < 0 || value >= NUMOFREGS) report_vm_error(ERR_REGISTER_OUT_OF_BOUNDS, vm->ip, "SET", "Register in input is invalid");
+  if(value < 0 || value >= NUMOFREGS){ vm_fault(vm, ERR_REGISTER_OUT_OF_BOUNDS, "SET", "Register in input is invalid"); return; }
   int reg_value = vm->registers[value];
   vm->stack[++vm->sp] = reg_value;
 }
@@ -111,23 +132,75 @@ void instr_lbl(VM *vm, const Instr* instrc){
 void instr_cmp(VM*vm, const Instr* instrc){
   int a = assess_operand(vm, instrc->operand1);
   int b = assess_operand(vm, instrc->operand2);
-  int assess = a - b;
+  if(vm->error != ERR_OK) return;
+  flags_from_cmp(&vm->flags, a, b);
 
-  vm->flags.zf = (assess == 0);
-  vm->flags.sf = (assess < 0);
-  vm->flags.of = ((a < 0 && b > 0 && assess > 0) ||
-                  (a > 0 && b < 0 && assess < 0));
+}
 
+//LOOP CHECK
+static inline int live_slots(int top, int size){
+  return top < 0 ? 0 : (top < size ? top + 1 : size);
 }
 
-void instr_jmp(VM* vm, const Instr* instrc) {
-  for (int i = 0; i < vm->lb; i++) {
-    if (strcmp(vm->labels[i].name, instrc->operand1.value.label) == 0) {
-      vm->ip = vm->labels[i].address;
-      return;
-    }
+//everything the rest of the run depends on is compared: stepcount only feeds MAXSTEPS and call_ctx follows the
+//callstack. the hash only sees the top LOOP_HASH_WINDOW slots of each stack so a back edge costs the same at any
+//depth, a difference further down is left to vm_state_equal
+static uint64_t vm_state_hash(const VM* vm){
+  uint64_t h = 0xcbf29ce484222325ull;
+#define MIX(v) (h = (h ^ (uint32_t)(v)) * 0x100000001b3ull)
+  MIX(vm->ip);
+  MIX(vm->sp);
+  MIX(vm->call_sp);
+  MIX(vm->flags.zf | (vm->flags.sf << 1) | (vm->flags.of << 2));
+  for(int r=0; r<NUMOFREGS; r++) MIX(vm->registers[r]);
+  int top = live_slots(vm->sp, STACKSIZE);
+  for(int d=top > LOOP_HASH_WINDOW ? top - LOOP_HASH_WINDOW : 0; d<top; d++) MIX(vm->stack[d]);
+  top = live_slots(vm->call_sp, CALLSIZE);
+  for(int d=top > LOOP_HASH_WINDOW ? top - LOOP_HASH_WINDOW : 0; d<top; d++) MIX(vm->callstack[d]);
+#undef MIX
+  return h;
+}
+
+static void vm_state_save(const VM* vm, LoopState* ls){
+  ls->ip = vm->ip;
+  ls->sp = vm->sp;
+  ls->call_sp = vm->call_sp;
+  ls->flags = vm->flags;
+  memcpy(ls->registers, vm->registers, sizeof(ls->registers));
+  memcpy(ls->stack, vm->stack, sizeof(int) * live_slots(vm->sp, STACKSIZE));
+  memcpy(ls->callstack, vm->callstack, sizeof(int) * live_slots(vm->call_sp, CALLSIZE));
+}
+
+static bool vm_state_equal(const VM* vm, const LoopState* ls){
+  return ls->ip == vm->ip && ls->sp == vm->sp && ls->call_sp == vm->call_sp &&
+    ls->flags.zf == vm->flags.zf && ls->flags.sf == vm->flags.sf && ls->flags.of == vm->flags.of &&
+    memcmp(ls->registers, vm->registers, sizeof(ls->registers)) == 0 &&
+    memcmp(ls->stack, vm->stack, sizeof(int) * live_slots(vm->sp, STACKSIZE)) == 0 &&
+    memcmp(ls->callstack, vm->callstack, sizeof(int) * live_slots(vm->call_sp, CALLSIZE)) == 0;
+}
+
+//any non-halting run loops through a backward jump, so checking there is enough. the saved state is replaced
+//at power-of-two intervals (Brent), a loop is caught within about twice its length in back edges once entered.
+//the copy happens log2(back edges) times, a hash match is only taken once the whole state compares equal
+void vm_back_edge(VM* vm){
+  uint64_t h = vm_state_hash(vm);
+  if(vm->loop_power && h == vm->loop_hash && vm_state_equal(vm, &vm->loop_state)){
+    vm_fault(vm, ERR_MAX_INSTRUCTIONS, "loop", "VM state repeated, program can never halt");
+    return;
+  }
+  if(++vm->loop_lam >= vm->loop_power){
+    vm->loop_hash = h;
+    vm_state_save(vm, &vm->loop_state);
+    vm->loop_power = vm->loop_power ? vm->loop_power * 2 : 1;
+    vm->loop_lam = 0;
   }
-  report_vm_error(ERR_UNRESOLVED_LABEL, vm->ip, "JMP", "label to jump not found");
+}
+
+void instr_jmp(VM* vm, const Instr* instrc) {
+  //target is resolved by link_labels at assembly time, unresolved labels never reach the VM
+  int from = vm->ip;
+  vm->ip = instrc->operand1.target;
+  if(LOOP_CHECK && vm->ip < from) vm_back_edge(vm);
 }
 
 void instr_je(VM*vm, const Instr* instrc){
@@ -162,22 +235,35 @@ void instr_jle(VM*vm, const Instr* instrc){
   }
 }
 
+//keyed on return address and depth, so RET undoes exactly what its CALL added and recursion doesn't cancel out
+static inline uint32_t call_ctx_key(int return_ip, int depth){
+  return ((uint32_t)return_ip ^ ((uint32_t)depth << 16)) * 0x9E3779B1u;
+}
+
 void instr_call(VM*vm, const Instr* instrc){
-  if(vm->call_sp + 1 >= CALLSIZE) report_vm_error(ERR_CALLSTACK_OVERFLOW, vm->ip, "CALL", "Call stack too full");
+  if(vm->call_sp + 1 >= CALLSIZE){ vm_fault(vm, ERR_CALLSTACK_OVERFLOW, "CALL", "Call stack too full"); return; }
   vm->callstack[++vm->call_sp] = vm->ip;
+  vm->call_ctx ^= call_ctx_key(vm->ip, vm->call_sp);
   instr_jmp(vm, instrc);
 }
 
 void instr_ret(VM*vm, const Instr* instrc){
   (void)instrc;
-  if(vm->call_sp < 0) report_vm_error(ERR_CALLSTACK_UNDERFLOW, vm->ip, "CALL", "Call stack empty");
-  vm->ip = vm->callstack[vm->call_sp--];
+  if(!GUARD_PAGE_STACKS && vm->call_sp < 0){ vm_fault(vm, ERR_CALLSTACK_UNDERFLOW, "CALL", "Call stack empty"); return; }
+  GUARD_BARRIER();
+  int return_ip = vm->callstack[vm->call_sp]; //read first, same reason as instr_add
+  vm->call_ctx ^= call_ctx_key(return_ip, vm->call_sp);
+  int from = vm->ip;
+  vm->ip = return_ip;
+  vm->call_sp--;
+  if(LOOP_CHECK && vm->ip < from) vm_back_edge(vm);
 }
 
 void instr_inc(VM*vm, const Instr* instrc){
   int register_index = instrc->operand1.value.reg;
   if(register_index < 0 || register_index >= NUMOFREGS){
-    report_vm_error(ERR_REGISTER_OUT_OF_BOUNDS, vm->ip, "INC", "Invalid register");
+    vm_fault(vm, ERR_REGISTER_OUT_OF_BOUNDS, "INC", "Invalid register");
+    return;
   }
   vm->registers[register_index]++;
 }
@@ -185,11 +271,477 @@ void instr_inc(VM*vm, const Instr* instrc){
 void instr_dec(VM*vm, const Instr* instrc){
   int register_index = instrc->operand1.value.reg;
   if(register_index < 0 || register_index >= NUMOFREGS){
-    report_vm_error(ERR_REGISTER_OUT_OF_BOUNDS, vm->ip, "INC", "Invalid register");
+    vm_fault(vm, ERR_REGISTER_OUT_OF_BOUNDS, "INC", "Invalid register");
+    return;
   }
   vm->registers[register_index]--;
 }
 
+//UNCHECKED
+//same as the handlers above minus the stack/callstack bounds check, verify_program has proven it never fires here
+
+void instr_psh_nc(VM*vm, const Instr* instrc){
+  vm->stack[++vm->sp] = instrc->operand1.value.imm;
+}
+
+void instr_add_nc(VM*vm, const Instr* instrc){ (void)instrc;
+  int op1 = vm->stack[vm->sp--];
+  int op2 = vm->stack[vm->sp--];
+  vm->stack[++vm->sp] = op1+op2;
+}
+
+void instr_sub_nc(VM*vm, const Instr* instrc){ (void)instrc;
+  int op1 = vm->stack[vm->sp--];
+  int op2 = vm->stack[vm->sp--];
+  vm->stack[++vm->sp] = op2-op1;
+}
+
+void instr_mul_nc(VM*vm, const Instr* instrc){ (void)instrc;
+  int op1 = vm->stack[vm->sp--];
+  int op2 = vm->stack[vm->sp--];
+  vm->stack[++vm->sp] = op1*op2;
+}
+
+void instr_div_nc(VM*vm, const Instr* instrc){ (void)instrc;
+  int op1 = vm->stack[vm->sp--];
+  int op2 = vm->stack[vm->sp--];
+  if(op1 == 0){
+    vm_fault(vm, ERR_DIVIDE_BY_ZERO, "DIV", "Division can't be done by zero\n");
+    return;
+  }
+  vm->stack[++vm->sp] = op2/op1;
+}
+
+void instr_pop_nc(VM*vm, const Instr* instrc){ (void)instrc;
+  vm->sp--;
+}
+
+//only rewritten when the register operand is in range too
+void instr_load_nc(VM*vm, const Instr* instrc){
+  vm->stack[++vm->sp] = vm->registers[instrc->operand1.value.reg];
+}
+
+void instr_call_nc(VM*vm, const Instr* instrc){
+  vm->callstack[++vm->call_sp] = vm->ip;
+  vm->call_ctx ^= call_ctx_key(vm->ip, vm->call_sp);
+  instr_jmp(vm, instrc);
+}
+
+void instr_ret_nc(VM*vm, const Instr* instrc){ (void)instrc;
+  vm->call_ctx ^= call_ctx_key(vm->callstack[vm->call_sp], vm->call_sp);
+  int from = vm->ip;
+  vm->ip = vm->callstack[vm->call_sp--];
+  if(LOOP_CHECK && vm->ip < from) vm_back_edge(vm);
+}
+
+
+//ENGINE
+
+//handlers stop at the first fault: the slot keeps what report_vm_error would have printed and the loop returns
+void vm_fault(VM* vm, Errors err, const char* instr, const char* detail){
+  vm->error = err;
+  vm->error_ip = vm->ip;
+  vm->error_instr = instr;
+  vm->error_detail = detail;
+  vm->running = false;
+}
+
+//opt-in old behaviour, for callers that run the VM in a throwaway child
+void vm_exit_on_error(const VM* vm){
+  if(vm->error != ERR_OK){
+    report_vm_error(vm->error, vm->error_ip, vm->error_instr, vm->error_detail);
+  }
+}
+
+//GUARD PAGES
+//one mapping per VM: [guard][stack][guard][callstack], each stack starting right after its guard page.
+//STACKSIZE and CALLSIZE are well under a page, so only the underflow side can sit on a boundary; the
+//overflow checks in PSH/LOAD/CALL stay, and POP never touches memory so it keeps its check too
+#if GUARD_PAGE_STACKS
+#include<signal.h>
+#include<setjmp.h>
+#include<unistd.h>
+#include<sys/mman.h>
+
+static size_t page_size(void){
+  static size_t page;
+  if(!page) page = (size_t)sysconf(_SC_PAGESIZE);
+  return page;
+}
+
+static size_t round_to_page(size_t bytes){
+  size_t page = page_size();
+  return (bytes + page - 1) / page * page;
+}
+
+static void guard_map(VM* vm){
+  size_t page = page_size();
+  size_t stack_bytes = round_to_page(sizeof(int) * STACKSIZE);
+  size_t call_bytes = round_to_page(sizeof(int) * CALLSIZE);
+  size_t total = page + stack_bytes + page + call_bytes;
+  char *map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(map == MAP_FAILED){
+    vm_fault(vm, ERR_ALLOC_FAIL, NULL, "Guarded stack mapping failed");
+    return;
+  }
+  mprotect(map, page, PROT_NONE);
+  mprotect(map + page + stack_bytes, page, PROT_NONE);
+  vm->guard_map = map;
+  vm->guard_map_size = total;
+  vm->stack = (int*)(map + page);
+  vm->callstack = (int*)(map + page + stack_bytes + page);
+}
+
+static sigjmp_buf guard_env;
+static VM *guard_vm; //the VM inside vm_run_guarded, its guard pages are the only faults handled here
+
+static void guard_handler(int sig, siginfo_t* info, void* ucontext){
+  (void)ucontext;
+  const char *addr = info->si_addr;
+  if(guard_vm){
+    size_t page = page_size();
+    const char *stack_guard = (const char*)guard_vm->stack - page;
+    const char *call_guard = (const char*)guard_vm->callstack - page;
+    if(addr >= stack_guard && addr < stack_guard + page) siglongjmp(guard_env, 1);
+    if(addr >= call_guard && addr < call_guard + page) siglongjmp(guard_env, 2);
+  }
+  //a real crash, returning reruns the access under the default action
+  signal(sig, SIG_DFL);
+}
+
+//the fault the skipped check would have raised, names and details as in the handlers
+static void guard_fault(VM* vm, int which){
+  if(which == 2){
+    vm_fault(vm, ERR_CALLSTACK_UNDERFLOW, "CALL", "Call stack empty");
+    return;
+  }
+  const char *name = "ADD";
+  switch(vm->program[vm->ip - 1].ID){
+    case SUB: name = "SUB"; break;
+    case MUL: name = "MUL"; break;
+    case DIV: name = "DIV"; break;
+    default: break;
+  }
+  vm_fault(vm, ERR_STACK_UNDERFLOW, name, "Stack doesn't contain enough operands for stack operation");
+}
+#endif
+
+void vm_run_guarded(VM* vm, VMEngine engine, VMTraceFunc trace){
+#if GUARD_PAGE_STACKS
+  static bool installed;
+  if(!installed){
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guard_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    installed = true;
+  }
+  VM *volatile self = vm;
+  guard_vm = vm;
+  int which = sigsetjmp(guard_env, 1);
+  if(which == 0) engine(vm, trace);
+  else guard_fault(self, which);
+  guard_vm = NULL;
+#else
+  engine(vm, trace);
+#endif
+}
+
+void vm_free(VM* vm){
+#if GUARD_PAGE_STACKS
+  if(vm->guard_map) munmap(vm->guard_map, vm->guard_map_size);
+  vm->guard_map = NULL;
+  vm->stack = NULL;
+  vm->callstack = NULL;
+#else
+  (void)vm;
+#endif
+}
+
+void vm_init(VM* vm, const Instr* program, int program_size){
+  memset(vm, 0, sizeof(VM));
+#if GUARD_PAGE_STACKS
+  guard_map(vm);
+#endif
+  vm->call_sp = -1;
+  vm->sp = -1;
+  vm->ip = 0;
+  vm->stepcount = 0;
+  vm->running = true;
+  vm->program = program;
+  vm->program_size = program_size;
+}
+
+//steps is the instruction's Instr.steps. an instruction standing for several reports MAXSTEPS at the same count
+//the unmerged ones would have stopped at
+static inline bool vm_count_step(VM* vm, int steps){
+  vm->stepcount += steps;
+  if(vm->stepcount >= MAXSTEPS){
+    vm->stepcount = MAXSTEPS;
+    vm_fault(vm, ERR_MAX_INSTRUCTIONS, NULL, "Exceeded maximum instruction count");
+    return false;
+  }
+  return true;
+}
+
+//program and size are passed in so the loops can keep them in locals, stores to vm->stack may alias anything reached through vm
+static inline const Instr* vm_fetch(VM* vm, const Instr* program, int program_size){
+  if(vm->ip < 0 || vm->ip >= program_size){
+    vm_fault(vm, ERR_PC_OUT_OF_BOUNDS, "index", "Instruction pointer out of bounds");
+    return NULL;
+  }
+  return &program[vm->ip];
+}
+
+//FUSED
+//each component is still its own step: the count and MAXSTEPS check the loop would have done between
+//them happen here, and ip moves exactly as if they were dispatched one by one, so errors report the same ip
+
+//fuse_program only fuses single-step components
+static inline bool fused_step(VM* vm){
+  if(vm->error != ERR_OK || !vm_count_step(vm, 1)) return false;
+  vm->ip++;
+  return true;
+}
+
+#define FUSED2(name, first, second) \
+  void name(VM*vm, const Instr* instrc){ \
+    first(vm, instrc); \
+    if(!fused_step(vm)) return; \
+    second(vm, instrc + 1); \
+  }
+
+#define FUSED3(name, first, second, third) \
+  void name(VM*vm, const Instr* instrc){ \
+    first(vm, instrc); \
+    if(!fused_step(vm)) return; \
+    second(vm, instrc + 1); \
+    if(!fused_step(vm)) return; \
+    third(vm, instrc + 2); \
+  }
+
+FUSED2(instr_cmp_je, instr_cmp, instr_je)
+FUSED2(instr_cmp_jne, instr_cmp, instr_jne)
+FUSED2(instr_cmp_jg, instr_cmp, instr_jg)
+FUSED2(instr_cmp_jge, instr_cmp, instr_jge)
+FUSED2(instr_cmp_jl, instr_cmp, instr_jl)
+FUSED2(instr_cmp_jle, instr_cmp, instr_jle)
+FUSED3(instr_psh_psh_add, instr_psh, instr_psh, instr_add)
+FUSED3(instr_psh_psh_sub, instr_psh, instr_psh, instr_sub)
+FUSED3(instr_psh_psh_mul, instr_psh, instr_psh, instr_mul)
+FUSED3(instr_psh_psh_div, instr_psh, instr_psh, instr_div)
+FUSED3(instr_load_load_add, instr_load, instr_load, instr_add)
+FUSED3(instr_load_load_sub, instr_load, instr_load, instr_sub)
+FUSED3(instr_load_load_mul, instr_load, instr_load, instr_mul)
+FUSED3(instr_load_load_div, instr_load, instr_load, instr_div)
+
+#undef FUSED3
+#undef FUSED2
+
+void vm_step(VM* vm, VMTraceFunc trace){
+  const Instr* instr = vm_fetch(vm, vm->program, vm->program_size);
+  if(!instr) return;
+  if(trace) trace(vm, instr);
+  vm->ip++;
+  instr->execute(vm, instr);
+  if(vm->error != ERR_OK) return;
+  vm_count_step(vm, instr->steps);
+}
+
+//reference loop, one indirect call per instruction
+void vm_run_indirect(VM* vm, VMTraceFunc trace){
+  while(vm->running){
+    vm_step(vm, trace);
+  }
+}
+
+//INSTRUMENTED LOOPS
+//vm_run and its variants share one body, each variant bakes its recording into the dispatch
+//so nothing goes through a per-step callback or touches memory it doesn't need
+
+static inline void cov_record(VM* vm, const Instr* instr, bool counts){
+  VMCoverage *cov = vm->cov;
+  uint32_t ip = (uint32_t)vm->ip;
+  uint32_t ctx = vm->call_ctx & cov->ctx_mask;
+  uint32_t vm_edge = (cov->direct && vm->program_size <= DIRECT_EDGE_STRIDE)
+    ? edge_map_next_direct(cov->vm_map, ip, ctx)
+    : edge_map_next(cov->vm_map, ip ^ ctx);
+  uint32_t asm_edge = edge_map_next(cov->asm_map, ((uint32_t)instr->ID << 16) | (ip & 0xFFFF));
+  if(counts){
+    edge_map_hit(cov->vm_map, vm_edge);
+    edge_map_hit(cov->asm_map, asm_edge);
+  }else{
+    edge_map_mark(cov->vm_map, vm_edge);
+    edge_map_mark(cov->asm_map, asm_edge);
+  }
+}
+
+//logs before the CMP runs, a bad register reads as 0 here and is left for the handler to report
+static inline int cmp_operand(const VM* vm, Operand op){
+  if(op.type == IMM) return op.value.imm;
+  if(op.type == REG && op.value.reg >= 0 && op.value.reg < NUMOFREGS) return vm->registers[op.value.reg];
+  return 0;
+}
+
+static inline void cov_log_cmp(VM* vm, const Instr* instr){
+  if(instr->ID != CMP && (instr->ID < CMP_JE || instr->ID > CMP_JLE)) return;
+  CmpLog *log = vm->cov->cmp_log;
+  if(log->count < CMPLOG_SIZE){
+    CmpLogEntry *e = &log->entries[log->count];
+    e->ip = (uint32_t)vm->ip;
+    e->a = cmp_operand(vm, instr->operand1);
+    e->b = cmp_operand(vm, instr->operand2);
+  }
+  log->count++;
+}
+
+#define VM_RUN_NAME vm_run
+#define VM_HOOK(vm, instr) do{ if(trace) trace(vm, instr); } while(0)
+#include "vm_run_template.h"
+
+#define VM_RUN_NAME vm_run_plain
+#define VM_HOOK(vm, instr) do{ } while(0)
+#include "vm_run_template.h"
+
+#define VM_RUN_NAME vm_run_edges
+#define VM_HOOK(vm, instr) do{ cov_record(vm, instr, false); if(trace) trace(vm, instr); } while(0)
+#include "vm_run_template.h"
+
+#define VM_RUN_NAME vm_run_hits
+#define VM_HOOK(vm, instr) do{ cov_record(vm, instr, true); if(trace) trace(vm, instr); } while(0)
+#include "vm_run_template.h"
+
+#define VM_RUN_NAME vm_run_cmplog
+#define VM_HOOK(vm, instr) do{ cov_record(vm, instr, true); cov_log_cmp(vm, instr); if(trace) trace(vm, instr); } while(0)
+#include "vm_run_template.h"
+
+//rebuilds the operands a handler reads from one packed word; handlers are inlined so fields they don't read are never computed
+static inline Instr bc_decode(const BytecodeProgram* bc, Bytecode w){
+  Instr d;
+  d.ID = BC_OP(w);
+  d.execute = NULL;
+  d.steps = BC_STEPS(w);
+  d.operand1.type = BC_TYPE1(w);
+  d.operand2.type = BC_TYPE2(w);
+  d.operand1.target = -1;
+  d.operand2.target = -1;
+
+  if(d.operand2.type != NONE){
+    d.operand2.value.imm = BC_IMM(w);
+    if(d.operand1.type == REG) d.operand1.value.reg = BC_REG(w);
+    else d.operand1.value.imm = bc->consts[BC_REG(w)];
+  } else {
+    d.operand1.value.imm = BC_IMM(w); //same bits as value.reg for LOAD/INC/DEC
+    d.operand1.target = BC_IMM(w);
+  }
+  return d;
+}
+
+#if defined(__GNUC__)
+void vm_run_bytecode(VM* vm, VMTraceFunc trace){
+  static void* const dispatch_table[NUM_OPCODES] = {
+    [PSH] = &&op_psh, [ADD] = &&op_add, [SUB] = &&op_sub, [MUL] = &&op_mul, [DIV] = &&op_div,
+    [POP] = &&op_pop, [SET] = &&op_set, [LOAD] = &&op_load, [HLT] = &&op_hlt, [LBL] = &&op_lbl,
+    [JMP] = &&op_jmp, [JE] = &&op_je, [JNE] = &&op_jne, [JG] = &&op_jg, [JGE] = &&op_jge,
+    [JL] = &&op_jl, [JLE] = &&op_jle, [CMP] = &&op_cmp, [CALL] = &&op_call, [RET] = &&op_ret,
+    [INC] = &&op_inc, [DEC] = &&op_dec,
+    [CMP_JE] = &&op_fused, [CMP_JNE] = &&op_fused, [CMP_JG] = &&op_fused, [CMP_JGE] = &&op_fused,
+    [CMP_JL] = &&op_fused, [CMP_JLE] = &&op_fused,
+    [PSH_PSH_ADD] = &&op_fused, [PSH_PSH_SUB] = &&op_fused,
+    [PSH_PSH_MUL] = &&op_fused, [PSH_PSH_DIV] = &&op_fused,
+    [LOAD_LOAD_ADD] = &&op_fused, [LOAD_LOAD_SUB] = &&op_fused,
+    [LOAD_LOAD_MUL] = &&op_fused, [LOAD_LOAD_DIV] = &&op_fused,
+    [PSH_NC] = &&op_psh_nc, [ADD_NC] = &&op_add_nc, [SUB_NC] = &&op_sub_nc, [MUL_NC] = &&op_mul_nc,
+    [DIV_NC] = &&op_div_nc, [POP_NC] = &&op_pop_nc, [LOAD_NC] = &&op_load_nc,
+    [CALL_NC] = &&op_call_nc, [RET_NC] = &&op_ret_nc
+  };
+  const BytecodeProgram bc_local = *vm->bytecode;
+  const BytecodeProgram* const bc = &bc_local;
+  const Instr* const program = vm->program;
+  Bytecode w;
+
+#define VM_DISPATCH() do{ \
+    if(vm->ip < 0 || vm->ip >= bc->size){ \
+      vm_fault(vm, ERR_PC_OUT_OF_BOUNDS, "index", "Instruction pointer out of bounds"); \
+      return; \
+    } \
+    w = bc->code[vm->ip]; \
+    if(trace) trace(vm, &program[vm->ip]); \
+    vm->ip++; \
+    goto *dispatch_table[BC_OP(w)]; \
+  } while(0)
+
+#define VM_NEXT() do{ if(vm->error != ERR_OK || !vm_count_step(vm, BC_STEPS(w))) return; VM_DISPATCH(); } while(0)
+#define BC_EXEC(handler) do{ Instr d = bc_decode(bc, w); handler(vm, &d); } while(0)
+
+  if(!vm->running) return;
+  VM_DISPATCH();
+
+op_psh:  BC_EXEC(instr_psh);  VM_NEXT();
+op_add:  BC_EXEC(instr_add);  VM_NEXT();
+op_sub:  BC_EXEC(instr_sub);  VM_NEXT();
+op_mul:  BC_EXEC(instr_mul);  VM_NEXT();
+op_div:  BC_EXEC(instr_div);  VM_NEXT();
+op_pop:  BC_EXEC(instr_pop);  VM_NEXT();
+op_set:  BC_EXEC(instr_set);  VM_NEXT();
+op_load: BC_EXEC(instr_load); VM_NEXT();
+op_lbl:  VM_NEXT();
+op_jmp:  BC_EXEC(instr_jmp);  VM_NEXT();
+op_je:   BC_EXEC(instr_je);   VM_NEXT();
+op_jne:  BC_EXEC(instr_jne);  VM_NEXT();
+op_jg:   BC_EXEC(instr_jg);   VM_NEXT();
+op_jge:  BC_EXEC(instr_jge);  VM_NEXT();
+op_jl:   BC_EXEC(instr_jl);   VM_NEXT();
+op_jle:  BC_EXEC(instr_jle);  VM_NEXT();
+op_cmp:  BC_EXEC(instr_cmp);  VM_NEXT();
+op_call: BC_EXEC(instr_call); VM_NEXT();
+op_ret:  BC_EXEC(instr_ret);  VM_NEXT();
+op_inc:  BC_EXEC(instr_inc);  VM_NEXT();
+op_dec:  BC_EXEC(instr_dec);  VM_NEXT();
+op_psh_nc:  BC_EXEC(instr_psh_nc);  VM_NEXT();
+op_add_nc:  BC_EXEC(instr_add_nc);  VM_NEXT();
+op_sub_nc:  BC_EXEC(instr_sub_nc);  VM_NEXT();
+op_mul_nc:  BC_EXEC(instr_mul_nc);  VM_NEXT();
+op_div_nc:  BC_EXEC(instr_div_nc);  VM_NEXT();
+op_pop_nc:  BC_EXEC(instr_pop_nc);  VM_NEXT();
+op_load_nc: BC_EXEC(instr_load_nc); VM_NEXT();
+op_call_nc: BC_EXEC(instr_call_nc); VM_NEXT();
+op_ret_nc:  BC_EXEC(instr_ret_nc);  VM_NEXT();
+op_fused:
+  //fused handlers read their trailing components, which only the Instr array has
+  program[vm->ip - 1].execute(vm, &program[vm->ip - 1]);
+  VM_NEXT();
+op_hlt:
+  vm->running = false;
+  vm_count_step(vm, BC_STEPS(w));
+  return;
+
+#undef BC_EXEC
+#undef VM_NEXT
+#undef VM_DISPATCH
+}
+#else
+void vm_run_bytecode(VM* vm, VMTraceFunc trace){
+  const BytecodeProgram* bc = vm->bytecode;
+  while(vm->running){
+    if(vm->ip < 0 || vm->ip >= bc->size){
+      vm_fault(vm, ERR_PC_OUT_OF_BOUNDS, "index", "Instruction pointer out of bounds");
+      return;
+    }
+    Bytecode w = bc->code[vm->ip];
+    if(trace) trace(vm, &vm->program[vm->ip]);
+    vm->ip++;
+    Instr d = bc_decode(bc, w);
+    if(d.ID >= OPCODE) vm->program[vm->ip - 1].execute(vm, &vm->program[vm->ip - 1]);
+    else lookup[d.ID].execute(vm, &d);
+    if(vm->error != ERR_OK) return;
+    vm_count_step(vm, BC_STEPS(w));
+  }
+}
+#endif
+
 
 /* //test 
 const Instr program[] = {
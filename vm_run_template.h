@@ -0,0 +1,116 @@
+//body of vm_run, included once per variant by vm_core.c. no include guard on purpose.
+//expects VM_RUN_NAME (the function to define) and VM_HOOK(vm, instr) (runs after fetch, before ip moves),
+//both are #undef'd at the end so the next variant can set its own
+#if !defined(VM_RUN_NAME) || !defined(VM_HOOK)
+#error "vm_run_template.h needs VM_RUN_NAME and VM_HOOK"
+#endif
+
+#if defined(__GNUC__)
+//direct threaded: every handler ends in its own fetch + indirect goto, so the branch predictor
+//gets one dispatch site per opcode instead of one shared call site. handlers are same-TU calls and get inlined
+void VM_RUN_NAME(VM* vm, VMTraceFunc trace){
+  static void* const dispatch_table[NUM_OPCODES] = {
+    [PSH] = &&op_psh, [ADD] = &&op_add, [SUB] = &&op_sub, [MUL] = &&op_mul, [DIV] = &&op_div,
+    [POP] = &&op_pop, [SET] = &&op_set, [LOAD] = &&op_load, [HLT] = &&op_hlt, [LBL] = &&op_lbl,
+    [JMP] = &&op_jmp, [JE] = &&op_je, [JNE] = &&op_jne, [JG] = &&op_jg, [JGE] = &&op_jge,
+    [JL] = &&op_jl, [JLE] = &&op_jle, [CMP] = &&op_cmp, [CALL] = &&op_call, [RET] = &&op_ret,
+    [INC] = &&op_inc, [DEC] = &&op_dec,
+    [CMP_JE] = &&op_cmp_je, [CMP_JNE] = &&op_cmp_jne, [CMP_JG] = &&op_cmp_jg, [CMP_JGE] = &&op_cmp_jge,
+    [CMP_JL] = &&op_cmp_jl, [CMP_JLE] = &&op_cmp_jle,
+    [PSH_PSH_ADD] = &&op_psh_psh_add, [PSH_PSH_SUB] = &&op_psh_psh_sub,
+    [PSH_PSH_MUL] = &&op_psh_psh_mul, [PSH_PSH_DIV] = &&op_psh_psh_div,
+    [LOAD_LOAD_ADD] = &&op_load_load_add, [LOAD_LOAD_SUB] = &&op_load_load_sub,
+    [LOAD_LOAD_MUL] = &&op_load_load_mul, [LOAD_LOAD_DIV] = &&op_load_load_div,
+    [PSH_NC] = &&op_psh_nc, [ADD_NC] = &&op_add_nc, [SUB_NC] = &&op_sub_nc, [MUL_NC] = &&op_mul_nc,
+    [DIV_NC] = &&op_div_nc, [POP_NC] = &&op_pop_nc, [LOAD_NC] = &&op_load_nc,
+    [CALL_NC] = &&op_call_nc, [RET_NC] = &&op_ret_nc
+  };
+  const Instr* const program = vm->program;
+  const int program_size = vm->program_size;
+  const Instr* instr;
+  (void)trace;
+
+#define VM_DISPATCH() do{ \
+    instr = vm_fetch(vm, program, program_size); \
+    if(!instr) return; \
+    VM_HOOK(vm, instr); \
+    vm->ip++; \
+    goto *dispatch_table[instr->ID]; \
+  } while(0)
+
+//a faulting handler returns with the error slot set, the step it failed on is not counted
+#define VM_NEXT() do{ if(vm->error != ERR_OK || !vm_count_step(vm, instr->steps)) return; VM_DISPATCH(); } while(0)
+
+  if(!vm->running) return;
+  VM_DISPATCH();
+
+op_psh:  instr_psh(vm, instr);  VM_NEXT();
+op_add:  instr_add(vm, instr);  VM_NEXT();
+op_sub:  instr_sub(vm, instr);  VM_NEXT();
+op_mul:  instr_mul(vm, instr);  VM_NEXT();
+op_div:  instr_div(vm, instr);  VM_NEXT();
+op_pop:  instr_pop(vm, instr);  VM_NEXT();
+op_set:  instr_set(vm, instr);  VM_NEXT();
+op_load: instr_load(vm, instr); VM_NEXT();
+op_lbl:  VM_NEXT();
+op_jmp:  instr_jmp(vm, instr);  VM_NEXT();
+op_je:   instr_je(vm, instr);   VM_NEXT();
+op_jne:  instr_jne(vm, instr);  VM_NEXT();
+op_jg:   instr_jg(vm, instr);   VM_NEXT();
+op_jge:  instr_jge(vm, instr);  VM_NEXT();
+op_jl:   instr_jl(vm, instr);   VM_NEXT();
+op_jle:  instr_jle(vm, instr);  VM_NEXT();
+op_cmp:  instr_cmp(vm, instr);  VM_NEXT();
+op_call: instr_call(vm, instr); VM_NEXT();
+op_ret:  instr_ret(vm, instr);  VM_NEXT();
+op_inc:  instr_inc(vm, instr);  VM_NEXT();
+op_dec:  instr_dec(vm, instr);  VM_NEXT();
+op_cmp_je:  instr_cmp_je(vm, instr);  VM_NEXT();
+op_cmp_jne: instr_cmp_jne(vm, instr); VM_NEXT();
+op_cmp_jg:  instr_cmp_jg(vm, instr);  VM_NEXT();
+op_cmp_jge: instr_cmp_jge(vm, instr); VM_NEXT();
+op_cmp_jl:  instr_cmp_jl(vm, instr);  VM_NEXT();
+op_cmp_jle: instr_cmp_jle(vm, instr); VM_NEXT();
+op_psh_psh_add: instr_psh_psh_add(vm, instr); VM_NEXT();
+op_psh_psh_sub: instr_psh_psh_sub(vm, instr); VM_NEXT();
+op_psh_psh_mul: instr_psh_psh_mul(vm, instr); VM_NEXT();
+op_psh_psh_div: instr_psh_psh_div(vm, instr); VM_NEXT();
+op_load_load_add: instr_load_load_add(vm, instr); VM_NEXT();
+op_load_load_sub: instr_load_load_sub(vm, instr); VM_NEXT();
+op_load_load_mul: instr_load_load_mul(vm, instr); VM_NEXT();
+op_load_load_div: instr_load_load_div(vm, instr); VM_NEXT();
+op_psh_nc:  instr_psh_nc(vm, instr);  VM_NEXT();
+op_add_nc:  instr_add_nc(vm, instr);  VM_NEXT();
+op_sub_nc:  instr_sub_nc(vm, instr);  VM_NEXT();
+op_mul_nc:  instr_mul_nc(vm, instr);  VM_NEXT();
+op_div_nc:  instr_div_nc(vm, instr);  VM_NEXT();
+op_pop_nc:  instr_pop_nc(vm, instr);  VM_NEXT();
+op_load_nc: instr_load_nc(vm, instr); VM_NEXT();
+op_call_nc: instr_call_nc(vm, instr); VM_NEXT();
+op_ret_nc:  instr_ret_nc(vm, instr);  VM_NEXT();
+op_hlt:
+  instr_hlt(vm, instr);
+  vm_count_step(vm, instr->steps);
+  return;
+
+#undef VM_NEXT
+#undef VM_DISPATCH
+}
+#else
+//same steps as vm_step, with the hook in place of the trace call
+void VM_RUN_NAME(VM* vm, VMTraceFunc trace){
+  (void)trace;
+  while(vm->running){
+    const Instr* instr = vm_fetch(vm, vm->program, vm->program_size);
+    if(!instr) return;
+    VM_HOOK(vm, instr);
+    vm->ip++;
+    instr->execute(vm, instr);
+    if(vm->error != ERR_OK) return;
+    vm_count_step(vm, instr->steps);
+  }
+}
+#endif
+
+#undef VM_HOOK
+#undef VM_RUN_NAME